@@ -91,6 +91,20 @@ MRuby::Build.new do |conf|
   # conf.enable_bintest = true
 end
 
+# x86-64 build of the JIT (build/host64)
+MRuby::Build.new('host64') do |conf|
+  toolchain :gcc
+
+  conf.cc.flags << %w(-g -O3 -Wall -Werror-implicit-function-declaration -fomit-frame-pointer -m64)
+  conf.linker.flags << %w(-lm -m64)
+  conf.linker.libraries << "stdc++"
+  conf.cxx.flags = conf.cc.flags + %w(-fno-operator-names)
+  conf.cxx.include_paths << "#{root}/xbyak"
+  enable_debug
+
+  conf.gembox 'default'
+end
+
 # Define cross build settings
 # MRuby::CrossBuild.new('32bit') do |conf|
 #   toolchain :gcc
@@ -41,6 +41,13 @@
 /* turn off generational GC by default */
 //#define MRB_GC_TURN_OFF_GENERATIONAL
 
+/* write native code of JIT traces to /tmp/perf-<pid>.map for Linux perf
+   (link with -pthread) */
+//#define MRBJIT_PERF_MAP
+
+/* print native code of JIT traces with instructions and side exits */
+//#define MRBJIT_DUMP_TRACE
+
 /* default size of khash table bucket */
 //#define KHASH_DEFAULT_SIZE 32
 
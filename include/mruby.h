@@ -78,7 +78,12 @@ typedef struct {
   int eidx;
   struct REnv *env;
 
+  /* JIT code assumes sizeof(mrb_callinfo) == 1 << CALLINFO_SIZE_SHIFT */
+#if defined(__x86_64__)
+  void *dummy[5];
+#else
   void *dummy[3];
+#endif
 } mrb_callinfo;
 
 enum mrb_fiber_state {
@@ -102,16 +107,90 @@ typedef struct mrbjit_code_info {
   struct mrbjit_code_info *prev_coi;
   mrb_code *caller_pc;
   void *(*entry)();
+  void *(*loop_entry)();	/* entry after guards of loop pre-header */
   mrbjit_reginfo *reginfo;	/* For Local assignment */
+  int pic_num;			/* classes guarded by polymorphic inline
+				   cache before this entry of it */
+  int loop_body;		/* guards are left to a loop pre-header
+				   before pc. Entered only from traces */
   int used;
 } mrbjit_code_info;
 
+/* Number of side exit counters (power of 2). Exits share a counter
+   when their addresses collide */
+#ifndef MRBJIT_EXIT_TAB_SIZE
+#define MRBJIT_EXIT_TAB_SIZE 256
+#endif
+#define MRBJIT_EXIT_HASH(exit) \
+  (((uintptr_t)(exit) >> 2) & (MRBJIT_EXIT_TAB_SIZE - 1))
+
+#define MRBJIT_OPCODE_NUM 128	/* GET_OPCODE is 7 bits */
+
+/* Guard which made the side exit */
+enum mrbjit_exit_kind {
+  MRBJIT_EXIT_OTHER = 0,	/* end of trace, call and so on */
+  MRBJIT_EXIT_TYPE,		/* type of VM register */
+  MRBJIT_EXIT_CLASS,		/* class or ivar layout of receiver */
+  MRBJIT_EXIT_BOOL,		/* branch of conditional jump */
+  MRBJIT_EXIT_INVALID,		/* invalidated dependency (mrbjit_invalidate) */
+  MRBJIT_EXIT_KIND_NUM
+};
+
+/* Counters of JIT (see mrbjit_get_stats and JIT.stats). Side exits
+   of each pc and guard are in jit_exit_stat of mrb_irep. compile_time is
+   measured only while stats_enabled of mrbjit_comp_info is set */
+typedef struct mrbjit_stats {
+  int traces;			/* traces recorded */
+  int aborts;			/* traces ended by instruction not compiled */
+  int abort_op[MRBJIT_OPCODE_NUM]; /* aborts by the opcode */
+  size_t code_size;		/* bytes of native code in use */
+  int side_exits;		/* times left native code by side exit */
+  double compile_time;		/* CPU seconds of this thread in compiler */
+} mrbjit_stats;
+
+/* Method cache of megamorphic send (see mrbjit_method_search).
+   Size is power of 2 */
+#ifndef MRBJIT_MCACHE_SIZE
+#define MRBJIT_MCACHE_SIZE 256
+#endif
+
+typedef struct mrbjit_mcache {
+  struct RClass *c;		/* receiver class. NULL if empty */
+  mrb_sym mid;
+  struct RProc *m;
+  struct RClass *owner;		/* class where m is found */
+} mrbjit_mcache;
+
 typedef struct mrbjit_comp_info {
   mrb_code *prev_pc;
   mrbjit_code_info *prev_coi;
-  mrbjit_code_area code_base;
+  mrbjit_code_area code_base;	/* code area while compiling a trace */
+  mrbjit_code_area code_area;	/* native code buffer of this state */
   int disable_jit;
   int nest_level;
+  struct mrb_irep *irep_list;	/* ireps which have jit_entry_tab */
+  size_t code_capa;		/* bytes of code_area */
+  size_t code_limit;		/* code_area grows up to this */
+  int flush_count;		/* times of code cache flush */
+  int thrash_count;		/* flush of code_area of code_limit */
+  int exit_count[MRBJIT_EXIT_TAB_SIZE]; /* times of side exit */
+  int exit_kind;		/* guard of the last side exit. Stored
+				   by the exit stub (see gen_exit) */
+  int exit_pic_num;		/* pic_num of the branch trace from the
+				   last class guard exit */
+  mrb_code *inline_pc;		/* send of method inlined in the trace */
+  void *trace_entry;		/* native code of the trace being compiled */
+  struct mrb_irep *trace_irep;	/* and its first instruction */
+  mrb_code *trace_pc;
+  struct mrbjit_dep *deps;	/* code depends on methods and so on */
+  int dep_num;
+  int dep_capa;
+  int stats_enabled;		/* measure compile_time (JIT.enable_stats) */
+  mrbjit_mcache mcache[MRBJIT_MCACHE_SIZE];
+  uint32_t *sym_hash;		/* hash value of Symbol key by mrb_sym,
+				   0 if not cached (see mrbjit_sym_hash) */
+  int sym_hash_size;
+  mrbjit_stats stats;
 } mrbjit_comp_info;
 
 struct mrb_context {
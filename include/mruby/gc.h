@@ -15,6 +15,17 @@ typedef void (mrb_each_object_callback)(mrb_state *mrb, struct RBasic *obj, void
 void mrb_objspace_each_objects(mrb_state *mrb, mrb_each_object_callback *callback, void *data);
 void mrb_free_context(mrb_state *mrb, struct mrb_context *c);
 
+/* Layout of free lists for allocation inlined by JIT code. First free
+   object of a heap page is taken while mrb->live is below
+   mrb->gc_threshold, otherwise mrb_obj_alloc must be called */
+typedef struct mrb_gc_alloc_layout {
+  size_t freelist;		/* offset of free list in heap page */
+  size_t next;			/* offset of next in free object */
+  size_t size;			/* size of object slot */
+} mrb_gc_alloc_layout;
+
+extern const mrb_gc_alloc_layout mrb_gc_alloc_layout_info;
+
 #if defined(__cplusplus)
 }  /* extern "C" { */
 #endif
@@ -54,10 +54,15 @@ typedef struct mrb_irep {
   struct RProc *proc_obj;
 
   /* JIT stuff */
-  int *prof_info;
   int jit_inlinep;
-  mrbjit_codetab *jit_entry_tab;
+  mrbjit_codetab *jit_entry_tab;	/* made when a trace head is hot */
+  mrbjit_prof *jit_prof;	/* trace heads until jit_entry_tab is made */
+  int jit_prof_num;
   void *(*jit_top_entry)();
+  struct mrb_irep *jit_next;	/* link of mrb->compile_info.irep_list */
+  struct mrb_irep *jit_prev;
+  mrbjit_exit_stat *jit_exit_stat;	/* side exits to this irep */
+  int jit_exit_stat_num;
   enum method_kind method_kind;
 } mrb_irep;
 
@@ -83,7 +88,11 @@ mrb_value mrb_load_irep_cxt(mrb_state*, const uint8_t*, mrbc_context*);
 void mrb_irep_free(mrb_state*, struct mrb_irep*);
 void mrb_irep_incref(mrb_state*, struct mrb_irep*);
 void mrb_irep_decref(mrb_state*, struct mrb_irep*);
+void mrbjit_make_jit_prof(mrb_state *, mrb_irep *);
 void mrbjit_make_jit_entry_tab(mrb_state *, mrb_irep *, int);
+void mrbjit_irep_link(mrb_state *, mrb_irep *);
+void mrbjit_irep_unlink(mrb_state *, mrb_irep *);
+void mrbjit_reset_code_info(mrb_state *);
 
 #if defined(__cplusplus)
 }  /* extern "C" { */
@@ -10,11 +10,87 @@
 #define COMPILE_THRESHOLD 10
 #define NO_INLINE_METHOD_LEN 0
 
+/* Methods up to this length are inlined without callinfo */
+#ifndef MRBJIT_INLINE_METHOD_LEN
+#define MRBJIT_INLINE_METHOD_LEN 16
+#endif
+
+/* caller_pc of code info in method inlined at send pc. Never equals
+   to pc of real callinfo */
+#define MRBJIT_INLINE_CALLER(pc) ((mrb_code *)((char *)(pc) + 1))
+
+/* Initial size of native code cache. When it is full, all code is
+   flushed and the cache is made twice as large up to code_limit of
+   mrbjit_comp_info (MRBJIT_CODE_LIMIT or JIT.code_limit=) */
+#ifndef MRBJIT_CODE_SIZE
+#define MRBJIT_CODE_SIZE (1024 * 1024)
+#endif
+
+#ifndef MRBJIT_CODE_LIMIT
+#define MRBJIT_CODE_LIMIT (16 * 1024 * 1024)
+#endif
+
+/* Side exit is linked to the trace of exit pc after taken this times */
+#ifndef MRBJIT_EXIT_THRESHOLD
+#define MRBJIT_EXIT_THRESHOLD 10
+#endif
+
+/* Call site is megamorphic when traces have guarded more receiver
+   classes than this */
+#ifndef MRBJIT_PIC_SIZE
+#define MRBJIT_PIC_SIZE 4
+#endif
+
+/* Traces of a pc specialized by previous pc. Paths reached after
+   this share the generic trace (prev_pc is NULL) */
+#ifndef MRBJIT_SPECIALIZE_MAX
+#define MRBJIT_SPECIALIZE_MAX 8
+#endif
+
+/* JIT is disabled when code cache of code_limit is flushed more than
+   this times */
+#ifndef MRBJIT_MAX_FLUSH
+#define MRBJIT_MAX_FLUSH 16
+#endif
+
+/* Code info of a pc. Open addressing hash table keyed by prev_pc and
+   caller_pc. size is power of 2 and num is kept under size / 2 */
 typedef struct mrbjit_codetab {
   int size;
-  mrbjit_code_info *body;
+  int num;
+  mrbjit_code_info *body;	/* allocated when pc is compiled */
+  int prof;			/* execution count. -1 if pc starts no trace */
+  void *ret_entry;		/* trace keyed by NULL prev_pc and caller_pc.
+				   Callee of send at pc - 1 returns to it */
 } mrbjit_codetab;
 
+/* Execution count of pc which starts traces (method entry and loop
+   head). An irep has them until the code table is made */
+typedef struct mrbjit_prof {
+  int pc;			/* offset in iseq */
+  int count;
+} mrbjit_prof;
+
+/* Side exits taken to a pc by a guard. An irep has one for each
+   (pc, kind) exited to (see mrbjit_stat_exit) */
+typedef struct mrbjit_exit_stat {
+  int pc;			/* offset in iseq */
+  enum mrbjit_exit_kind kind;
+  int count;
+} mrbjit_exit_stat;
+
+/* What native code assumes. The code exits when it is changed */
+enum mrbjit_dep_kind {
+  MRBJIT_DEP_METHOD,		/* method lookup of the name */
+  MRBJIT_DEP_CONST		/* value of the constant */
+};
+
+typedef struct mrbjit_dep {
+  enum mrbjit_dep_kind kind;
+  mrb_sym sym;
+  void *site;			/* jmp rel32 made by gen_dependency */
+} mrbjit_dep;
+
 typedef enum {
   LOCALJUMP_ERROR_RETURN = 0,
   LOCALJUMP_ERROR_BREAK = 1,
@@ -32,6 +108,16 @@ struct REnv* mrbjit_top_env(mrb_state *, struct RProc *);
 void mrbjit_localjump_error(mrb_state *, localjump_error_kind);
 
 mrbjit_code_info *mrbjit_search_codeinfo_prev(mrbjit_codetab *, mrb_code *, mrb_code *);
+void mrbjit_grow_codetab(mrb_state *, mrbjit_codetab *, int);
+const mrbjit_stats *mrbjit_get_stats(mrb_state *);
+extern const char *mrbjit_exit_kind_name[MRBJIT_EXIT_KIND_NUM];
+void mrbjit_add_dependency(mrb_state *, enum mrbjit_dep_kind, mrb_sym, void *);
+void mrbjit_drop_dependency(mrb_state *, const void *);
+void mrbjit_invalidate(mrb_state *, enum mrbjit_dep_kind, mrb_sym);
+struct RProc *mrbjit_method_search(mrb_state *, struct RClass **, mrb_sym);
+void mrbjit_mcache_clear_class(mrb_state *, struct RClass *);
+mrbjit_code_area mrbjit_alloc_code(size_t);
+void mrbjit_free_code(mrbjit_code_area);
 
 #define ISEQ_OFFSET_OF(pc) ((size_t)((pc) - irep->iseq))
 
@@ -5,7 +5,22 @@ extern mrb_value mrbjit_prim_fix_to_f(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_obj_not_equal_m(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_ary_aget(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_ary_aset(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_size(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_empty_p(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_first(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_last(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_pop(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_ary_push(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_hash_aget(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_hash_aset(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_hash_has_key(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_instance_new(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_fiber_resume(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_enum_all(mrb_state *, mrb_value, void *, void *);
 extern mrb_value mrbjit_prim_math_sqrt(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_flo_floor(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_flo_ceil(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_flo_round(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_flo_truncate(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_num_abs(mrb_state *, mrb_value, void *, void *);
+extern mrb_value mrbjit_prim_num_pow(mrb_state *, mrb_value, void *, void *);
@@ -133,6 +133,14 @@ enum mrb_vtype {
 #define MRB_ENDIAN_LOHI(a,b) b a
 #endif
 
+/* 64 bit pointers are packed in value.p (see below), so only 32 bit
+   pointers have their own field. mrb_value is 8 bytes on both */
+#if defined(__x86_64__)
+#define MRB_VALUE_P0
+#else
+#define MRB_VALUE_P0 void *p0;
+#endif
+
 typedef struct mrb_value {
   union {
     mrb_float f;
@@ -142,7 +150,7 @@ typedef struct mrb_value {
 	MRB_ENDIAN_LOHI(
  	  uint32_t ttt;
           ,union {
-	    void *p0;
+	    MRB_VALUE_P0
 	    mrb_int i;
 	    mrb_sym sym;
 	  };
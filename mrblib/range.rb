@@ -13,11 +13,22 @@ class Range
     return to_enum :each unless block_given?
 
     val = self.first
+    last = self.last
+
+    if val.kind_of?(Fixnum) && last.kind_of?(Fixnum) # fast path for integers
+      lim = last
+      lim += 1 unless exclude_end?
+
+      while val < lim
+        block.call(val)
+        val += 1
+      end
+      return self
+    end
+
     unless val.respond_to? :succ
       raise TypeError, "can't iterate"
     end
-
-    last = self.last
     return self if (val <=> last) > 0
 
     while((val <=> last) < 0)
@@ -15,6 +15,7 @@
 #include "mruby/variable.h"
 #include "mruby/error.h"
 #include "mruby/data.h"
+#include "mruby/jit.h"
 
 #include "mruby/primitive.h"
 
@@ -50,6 +51,7 @@ void
 mrb_gc_free_mt(mrb_state *mrb, struct RClass *c)
 {
   kh_destroy(mt, mrb, c->mt);
+  mrbjit_mcache_clear_class(mrb, c);
 }
 
 static void
@@ -64,6 +66,7 @@ setup_class(mrb_state *mrb, struct RClass *outer, struct RClass *c, mrb_sym id)
 {
   name_class(mrb, c, id);
   mrb_obj_iv_set(mrb, (struct RObject*)outer, id, mrb_obj_value(c));
+  mrbjit_invalidate(mrb, MRBJIT_DEP_CONST, id);
   if (outer != mrb->object_class) {
     mrb_obj_iv_set(mrb, (struct RObject*)c, mrb_intern_lit(mrb, "__outer__"),
                    mrb_obj_value(outer));
@@ -320,6 +323,7 @@ mrb_define_method_raw(mrb_state *mrb, struct RClass *c, mrb_sym mid, struct RPro
   if (p) {
     mrb_field_write_barrier(mrb, (struct RBasic *)c, (struct RBasic *)p);
   }
+  mrbjit_invalidate(mrb, MRBJIT_DEP_METHOD, mid);
 }
 
 void
@@ -405,6 +409,7 @@ mrb_define_method_vm(mrb_state *mrb, struct RClass *c, mrb_sym name, mrb_value b
   if (p) {
     mrb_field_write_barrier(mrb, (struct RBasic *)c, (struct RBasic *)p);
   }
+  mrbjit_invalidate(mrb, MRBJIT_DEP_METHOD, name);
 }
 
 static mrb_value
@@ -803,6 +808,8 @@ mrb_include_module(mrb_state *mrb, struct RClass *c, struct RClass *m)
 {
   struct RClass *ins_pos;
 
+  /* Any method lookup of c may change */
+  mrbjit_invalidate(mrb, MRBJIT_DEP_METHOD, 0);
   ins_pos = c;
   while (m) {
     struct RClass *p = c, *ic;
@@ -1836,6 +1843,7 @@ remove_method(mrb_state *mrb, mrb_value mod, mrb_sym mid)
     k = kh_get(mt, mrb, h, mid);
     if (k != kh_end(h)) {
       kh_del(mt, mrb, h, k);
+      mrbjit_invalidate(mrb, MRBJIT_DEP_METHOD, mid);
       return;
     }
   }
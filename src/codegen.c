@@ -2538,20 +2538,92 @@ scope_new(mrb_state *mrb, codegen_scope *prev, node *lv)
   return p;
 }
 
+static int
+backward_jump_p(mrb_code c, int i)
+{
+  switch (GET_OPCODE(c)) {
+  case OP_JMP:
+  case OP_JMPIF:
+  case OP_JMPNOT:
+    return GETARG_sBx(c) <= 0 && i + GETARG_sBx(c) >= 0;
+
+  default:
+    return 0;
+  }
+}
+
+/* Only method entry and targets of backward jump (loop head) are
+   profiled and start traces. Most ireps never get hot, so they have
+   only these counters and no code table */
+void
+mrbjit_make_jit_prof(mrb_state *mrb, mrb_irep *irep)
+{
+  mrbjit_prof *prof;
+  int num;
+  int i;
+  int j;
+
+  irep->jit_entry_tab = NULL;
+  irep->jit_top_entry = NULL;
+  irep->jit_prof = NULL;
+  irep->jit_prof_num = 0;
+  if (irep->ilen == 0) {
+    return;
+  }
+
+  num = 1;
+  for (i = 0; i < irep->ilen; i++) {
+    if (backward_jump_p(irep->iseq[i], i)) {
+      num++;
+    }
+  }
+  prof = (mrbjit_prof *)mrb_malloc(mrb, sizeof(mrbjit_prof) * num);
+  prof[0].pc = 0;
+  prof[0].count = 0;
+  num = 1;
+  for (i = 0; i < irep->ilen; i++) {
+    mrb_code c = irep->iseq[i];
+
+    if (backward_jump_p(c, i)) {
+      for (j = 0; j < num && prof[j].pc != i + GETARG_sBx(c); j++);
+      if (j == num) {
+	prof[num].pc = i + GETARG_sBx(c);
+	prof[num].count = 0;
+	num++;
+      }
+    }
+  }
+
+  irep->jit_prof = prof;
+  irep->jit_prof_num = num;
+}
+
+/* Code table of all pc is made when a trace head of the irep is hot
+   (see mrbjit_dispatch). Code info of each pc is allocated when the
+   pc is compiled */
 void
 mrbjit_make_jit_entry_tab(mrb_state *mrb, mrb_irep *irep, int ilen)
 {
+  mrbjit_codetab *tab;
   int i;
 
-  irep->jit_entry_tab = (mrbjit_codetab *)mrb_calloc(mrb, ilen, sizeof(mrbjit_codetab));
+  if (irep->jit_prof == NULL) {
+    mrbjit_make_jit_prof(mrb, irep);
+  }
+  tab = (mrbjit_codetab *)mrb_calloc(mrb, ilen, sizeof(mrbjit_codetab));
   for (i = 0; i < ilen; i++) {
-    irep->jit_entry_tab[i].size = 2;
-    irep->jit_entry_tab[i].body = 
-      (mrbjit_code_info *)mrb_calloc(mrb, 2, sizeof(mrbjit_code_info));
+    tab[i].prof = -1;
+  }
+  for (i = 0; i < irep->jit_prof_num; i++) {
+    tab[irep->jit_prof[i].pc].prof = irep->jit_prof[i].count;
   }
+  mrb_free(mrb, irep->jit_prof);
+  irep->jit_prof = NULL;
+  irep->jit_prof_num = 0;
 
-  irep->prof_info = (int *)mrb_calloc(mrb, ilen, sizeof(int));
+  irep->jit_entry_tab = tab;
   irep->jit_top_entry = NULL;
+  mrbjit_irep_link(mrb, irep);
 }
 
 static void
@@ -2573,7 +2645,7 @@ scope_finish(codegen_scope *s)
       irep->lines = 0;
     }
   }
-  mrbjit_make_jit_entry_tab(mrb, irep, s->pc);
+  mrbjit_make_jit_prof(mrb, irep);
   irep->method_kind = NORMAL;
   //irep->jit_inlinep = s->irep->jit_inlinep;
   irep->pool = (mrb_value*)codegen_realloc(s, irep->pool, sizeof(mrb_value)*irep->plen);
@@ -4,6 +4,7 @@
 ** See Copyright Notice in mruby.h
 */
 
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include "mruby.h"
@@ -253,6 +254,12 @@ struct heap_page {
   RVALUE objects[MRB_HEAP_PAGE_SIZE];
 };
 
+const mrb_gc_alloc_layout mrb_gc_alloc_layout_info = {
+  offsetof(struct heap_page, freelist),
+  offsetof(struct free_obj, next),
+  sizeof(RVALUE),
+};
+
 static void
 link_heap_page(mrb_state *mrb, struct heap_page *page)
 {
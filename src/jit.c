@@ -13,7 +13,12 @@
 #include "mruby/proc.h"
 #include "mruby/class.h"
 #include "mruby/array.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/debug.h"
+#include "mruby/gc.h"
 #include <stddef.h>
+#include <string.h>
 #include <stdio.h>
 #include <setjmp.h>
 
@@ -105,7 +110,7 @@ mrbjit_exec_extend_callinfo(mrb_state *mrb, struct mrb_context *cxt, int size)
 
   cxt->cibase_org = (mrb_callinfo *)mrb_malloc(mrb, sizeof(mrb_callinfo)*size*2 + 64);
   sci = cxt->cibase;
-  cxt->cibase = (mrb_callinfo *)((((int)(cxt->cibase_org)) & (~(64 - 1))) + 64);
+  cxt->cibase = (mrb_callinfo *)((((intptr_t)(cxt->cibase_org)) & (~(64 - 1))) + 64);
   for (dci = cxt->cibase; sci <= cxt->ci; sci++, dci++) {
     *dci = *sci;
   }
@@ -140,7 +145,7 @@ mrbjit_exec_send_mruby(mrb_state *mrb, mrbjit_vmstatus *status,
     size_t size = ci - cxt->cibase;
 
     cxt->cibase_org = (mrb_callinfo *)mrb_realloc(mrb, cxt->cibase_org, sizeof(mrb_callinfo)*size*2 + 64);
-    cxt->cibase = (mrb_callinfo *)((((int)(cxt->cibase_org)) & (~(64 - 1))) + 64);
+    cxt->cibase = (mrb_callinfo *)((((intptr_t)(cxt->cibase_org)) & (~(64 - 1))) + 64);
     cxt->ci = cxt->cibase + size;
     cxt->ciend = cxt->cibase + size * 2;
   }
@@ -179,6 +184,36 @@ mrbjit_exec_send_mruby(mrb_state *mrb, mrbjit_vmstatus *status,
   return NULL;
 }
 
+/* Send of megamorphic call site. Method is searched at every call
+   through the method cache. C function is called here. For Ruby method, callinfo is pushed and
+   pc is moved to top of the method */
+void *
+mrbjit_exec_send_mega(mrb_state *mrb, mrbjit_vmstatus *status)
+{
+  mrb_code *pc = *status->pc;
+  mrb_value *regs = *status->regs;
+  mrb_irep *irep = *status->irep;
+  mrb_code i = *pc;
+  int a = GETARG_A(i);
+  int n = GETARG_C(i);
+  mrb_sym mid = irep->syms[GETARG_B(i)];
+  struct RClass *c = mrb_class(mrb, regs[a]);
+  struct RProc *m = mrbjit_method_search(mrb, &c, mid);
+
+  if (!m) {
+    /* method_missing is done by the interpreter */
+    return status->optable[GET_OPCODE(i)];
+  }
+  if (GET_OPCODE(i) == OP_SEND) {
+    SET_NIL_VALUE(regs[a+n+1]);
+  }
+
+  if (MRB_PROC_CFUNC_P(m)) {
+    return mrbjit_exec_send_c(mrb, status, m, c);
+  }
+  return mrbjit_exec_send_mruby(mrb, status, m, c);
+}
+
 void *
 mrbjit_exec_enter(mrb_state *mrb, mrbjit_vmstatus *status)
 {
@@ -506,6 +541,511 @@ mrbjit_exec_call(mrb_state *mrb, mrbjit_vmstatus *status)
   return NULL;
 }
 
+/* OP_EPUSH. Same as the interpreter */
+void
+mrbjit_exec_epush(mrb_state *mrb, mrb_irep *irep)
+{
+  struct mrb_context *c = mrb->c;
+  int ai = mrb_gc_arena_save(mrb);
+  struct RProc *p;
+
+  p = mrb_closure_new(mrb, irep);
+  if (c->esize <= c->ci->eidx) {
+    if (c->esize == 0) c->esize = 16;
+    else c->esize *= 2;
+    c->ensure = (struct RProc **)mrb_realloc(mrb, c->ensure, sizeof(struct RProc*) * c->esize);
+  }
+  c->ensure[c->ci->eidx++] = p;
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+/* OP_EPOP. Same as the interpreter. ecall runs the ensure clause
+   with JIT disabled */
+void
+mrbjit_exec_epop(mrb_state *mrb, int a)
+{
+  mrb_callinfo *ci = mrb->c->ci;
+  int ai = mrb_gc_arena_save(mrb);
+  int n, eidx = ci->eidx;
+
+  for (n = 0; n < a && eidx > ci[-1].eidx; n++) {
+    mrbjit_ecall(mrb, --eidx);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+/* OP_STRING. Same as the interpreter */
+mrb_value
+mrbjit_exec_string(mrb_state *mrb, mrb_value lit)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value str = mrb_str_dup(mrb, lit);
+
+  mrb_gc_arena_restore(mrb, ai);
+  return str;
+}
+
+/* OP_STRCAT. mrb_str_concat may call to_s */
+void
+mrbjit_exec_strcat(mrb_state *mrb, mrb_value str, mrb_value str2)
+{
+  int orgdisflg = mrb->compile_info.disable_jit;
+
+  mrb->compile_info.disable_jit = 1;
+  mrb_str_concat(mrb, str, str2);
+  mrb->compile_info.disable_jit = orgdisflg;
+}
+
+/* Hash value of Symbol key. mrb_hash_ht_hash scans the symbol table
+   for the name of Symbol, so the value is cached by mrb_sym for the
+   inline Hash lookup (see gen_hash_lookup) */
+uint32_t
+mrbjit_sym_hash(mrb_state *mrb, mrb_sym sym)
+{
+  mrbjit_comp_info *ci = &mrb->compile_info;
+  uint32_t h;
+
+  if (sym >= ci->sym_hash_size) {
+    int size = mrb->symidx + 1;
+
+    ci->sym_hash = (uint32_t *)mrb_realloc(mrb, ci->sym_hash, sizeof(uint32_t) * size);
+    memset(ci->sym_hash + ci->sym_hash_size, 0,
+	   sizeof(uint32_t) * (size - ci->sym_hash_size));
+    ci->sym_hash_size = size;
+  }
+  h = mrb_hash_ht_hash(mrb, mrb_symbol_value(sym));
+  ci->sym_hash[sym] = h;
+
+  return h;
+}
+
+/* Miss of inlined Hash#[]. Default proc is Ruby code */
+mrb_value
+mrbjit_exec_hash_get(mrb_state *mrb, mrb_value hash, mrb_value key)
+{
+  int orgdisflg = mrb->compile_info.disable_jit;
+  mrb_value val;
+
+  mrb->compile_info.disable_jit = 1;
+  val = mrb_hash_get(mrb, hash, key);
+  mrb->compile_info.disable_jit = orgdisflg;
+  return val;
+}
+
+/* Miss of inlined Hash#[]= */
+void
+mrbjit_exec_hash_set(mrb_state *mrb, mrb_value hash, mrb_value key, mrb_value val)
+{
+  int orgdisflg = mrb->compile_info.disable_jit;
+
+  mrb->compile_info.disable_jit = 1;
+  mrb_hash_set(mrb, hash, key, val);
+  mrb->compile_info.disable_jit = orgdisflg;
+}
+
+/* OP_HASH. Same as the interpreter. mrb_hash_set may call hash and
+   eql? of keys */
+mrb_value
+mrbjit_exec_hash(mrb_state *mrb, mrb_value *kv, int c)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  int orgdisflg = mrb->compile_info.disable_jit;
+  mrb_value hash = mrb_hash_new_capa(mrb, c);
+  int i;
+
+  mrb->compile_info.disable_jit = 1;
+  for (i = 0; i < c * 2; i += 2) {
+    mrb_hash_set(mrb, hash, kv[i], kv[i + 1]);
+  }
+  mrb->compile_info.disable_jit = orgdisflg;
+  mrb_gc_arena_restore(mrb, ai);
+  return hash;
+}
+
+void
+mrbjit_irep_link(mrb_state *mrb, mrb_irep *irep)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+
+  if (irep->jit_prev || cinfo->irep_list == irep) {
+    return;			/* already linked */
+  }
+  irep->jit_prev = NULL;
+  irep->jit_next = cinfo->irep_list;
+  if (cinfo->irep_list) {
+    cinfo->irep_list->jit_prev = irep;
+  }
+  cinfo->irep_list = irep;
+}
+
+void
+mrbjit_irep_unlink(mrb_state *mrb, mrb_irep *irep)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+
+  if (irep->jit_prev) {
+    irep->jit_prev->jit_next = irep->jit_next;
+  }
+  else if (cinfo->irep_list == irep) {
+    cinfo->irep_list = irep->jit_next;
+  }
+  else {
+    return;			/* not linked */
+  }
+  if (irep->jit_next) {
+    irep->jit_next->jit_prev = irep->jit_prev;
+  }
+  irep->jit_next = irep->jit_prev = NULL;
+}
+
+static void
+reset_callinfo_entry(struct mrb_context *c)
+{
+  mrb_callinfo *ci;
+
+  if (c == NULL || c->cibase == NULL) {
+    return;
+  }
+  for (ci = c->cibase; ci <= c->ci; ci++) {
+    ci->jit_entry = NULL;
+  }
+}
+
+static void
+reset_fiber_callinfo_entry(mrb_state *mrb, struct RBasic *obj, void *data)
+{
+  if (obj->tt == MRB_TT_FIBER) {
+    reset_callinfo_entry(((struct RFiber *)obj)->cxt);
+  }
+}
+
+/* Forget all native code after the code cache is flushed.
+   Compiled paths become not compiled (used = -1) and profile counts
+   are cleared, so only paths which are hot again are recompiled.
+   Return addresses in callinfo of all contexts, suspended fibers
+   included, are cleared. */
+void
+mrbjit_reset_code_info(mrb_state *mrb)
+{
+  mrb_irep *irep;
+  size_t i;
+  int j;
+
+  for (irep = mrb->compile_info.irep_list; irep; irep = irep->jit_next) {
+    for (i = 0; i < irep->ilen; i++) {
+      mrbjit_codetab *tab = irep->jit_entry_tab + i;
+
+      for (j = 0; j < tab->size; j++) {
+	if (tab->body[j].used != 0) {
+	  tab->body[j].used = -1;
+	}
+	tab->body[j].entry = NULL;
+	tab->body[j].code_base = NULL;
+	tab->body[j].prev_coi = NULL;
+      }
+      if (tab->prof > 0) {
+	tab->prof = 0;
+      }
+      tab->ret_entry = NULL;
+    }
+    irep->jit_top_entry = NULL;
+  }
+
+  reset_callinfo_entry(mrb->root_c);
+  if (mrb->c != mrb->root_c) {
+    reset_callinfo_entry(mrb->c);
+  }
+  mrb_objspace_each_objects(mrb, reset_fiber_callinfo_entry, NULL);
+
+  mrb->compile_info.prev_pc = NULL;
+  mrb->compile_info.prev_coi = NULL;
+  mrb->compile_info.code_base = NULL;
+  mrb->compile_info.nest_level = 0;
+  memset(mrb->compile_info.exit_count, 0, sizeof(mrb->compile_info.exit_count));
+  mrb->compile_info.dep_num = 0;
+}
+
+/* Register native code at site depends on sym */
+void
+mrbjit_add_dependency(mrb_state *mrb, enum mrbjit_dep_kind kind, mrb_sym sym, void *site)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+  mrbjit_dep *dep;
+
+  if (cinfo->dep_num >= cinfo->dep_capa) {
+    cinfo->dep_capa = cinfo->dep_capa * 2 + 16;
+    cinfo->deps = (mrbjit_dep *)mrb_realloc(mrb, cinfo->deps,
+					    sizeof(mrbjit_dep) * cinfo->dep_capa);
+  }
+  dep = cinfo->deps + cinfo->dep_num++;
+  dep->kind = kind;
+  dep->sym = sym;
+  dep->site = site;
+}
+
+/* Code from address from is discarded. It is the last made */
+void
+mrbjit_drop_dependency(mrb_state *mrb, const void *from)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+
+  while (cinfo->dep_num > 0 &&
+	 (const char *)cinfo->deps[cinfo->dep_num - 1].site >= (const char *)from) {
+    cinfo->dep_num--;
+  }
+}
+
+/* sym of kind is changed. Make the code depending on it exit. sym 0
+   means all of kind (e.g. include changes any method lookup) */
+void
+mrbjit_invalidate(mrb_state *mrb, enum mrbjit_dep_kind kind, mrb_sym sym)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+  int i = 0;
+
+  if (kind == MRBJIT_DEP_METHOD) {
+    for (i = 0; i < MRBJIT_MCACHE_SIZE; i++) {
+      if (sym == 0 || cinfo->mcache[i].mid == sym) {
+	cinfo->mcache[i].c = NULL;
+      }
+    }
+    i = 0;
+  }
+
+  while (i < cinfo->dep_num) {
+    mrbjit_dep *dep = cinfo->deps + i;
+
+    if (dep->kind == kind && (sym == 0 || dep->sym == sym)) {
+      /* jmp over the exit becomes jmp to it */
+      memset((char *)dep->site + 1, 0, 4);
+      *dep = cinfo->deps[--cinfo->dep_num];
+    }
+    else {
+      i++;
+    }
+  }
+}
+
+#define MRBJIT_MCACHE_HASH(c, mid) \
+  ((((uintptr_t)(c) >> 4) ^ (mid)) & (MRBJIT_MCACHE_SIZE - 1))
+
+/* mrb_method_search_vm with the method cache. Entries are cleared when
+   a method is defined or removed, a module is included (see
+   mrbjit_invalidate) or the class is freed */
+struct RProc *
+mrbjit_method_search(mrb_state *mrb, struct RClass **cp, mrb_sym mid)
+{
+  mrbjit_mcache *e = mrb->compile_info.mcache + MRBJIT_MCACHE_HASH(*cp, mid);
+  struct RClass *c = *cp;
+  struct RProc *m;
+
+  if (e->c == c && e->mid == mid) {
+    *cp = e->owner;
+    return e->m;
+  }
+  m = mrb_method_search_vm(mrb, cp, mid);
+  if (m) {
+    e->c = c;
+    e->mid = mid;
+    e->m = m;
+    e->owner = *cp;
+  }
+  return m;
+}
+
+void
+mrbjit_mcache_clear_class(mrb_state *mrb, struct RClass *c)
+{
+  mrbjit_mcache *mcache = mrb->compile_info.mcache;
+  int i;
+
+  for (i = 0; i < MRBJIT_MCACHE_SIZE; i++) {
+    if (mcache[i].c == c || mcache[i].owner == c) {
+      mcache[i].c = NULL;
+    }
+  }
+}
+
+extern size_t mrbjit_code_size(mrbjit_code_area);
+
+const char *mrbjit_exit_kind_name[MRBJIT_EXIT_KIND_NUM] = {
+  "other", "type", "class", "bool", "invalid"
+};
+
+const mrbjit_stats *
+mrbjit_get_stats(mrb_state *mrb)
+{
+  mrbjit_stats *stats = &mrb->compile_info.stats;
+
+  if (mrb->compile_info.code_area) {
+    stats->code_size = mrbjit_code_size(mrb->compile_info.code_area);
+  }
+  return stats;
+}
+
+/*
+ *  call-seq:
+ *     JIT.stats -> hash
+ *
+ *  Returns counters of JIT.
+ *  :abort_ops is hash of opcode number to times it ended trace.
+ *  :exit_kinds is hash of guard to times its side exit was taken.
+ *  :exits is array of [filename, line, pc, guard, times] of side exits.
+ *  :compile_time is measured only after JIT.enable_stats.
+ *  :code_capa is bytes of the code cache, see JIT.code_limit.
+ *
+ */
+
+static mrb_value
+jit_stats(mrb_state *mrb, mrb_value self)
+{
+  const mrbjit_stats *stats = mrbjit_get_stats(mrb);
+  mrb_value hash = mrb_hash_new(mrb);
+  mrb_value ops = mrb_hash_new(mrb);
+  mrb_value kinds = mrb_hash_new(mrb);
+  mrb_value exits = mrb_ary_new(mrb);
+  int kind_count[MRBJIT_EXIT_KIND_NUM] = {0};
+  mrb_irep *irep;
+  size_t i;
+  int k;
+
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "traces")),
+	       mrb_fixnum_value(stats->traces));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "aborts")),
+	       mrb_fixnum_value(stats->aborts));
+  for (i = 0; i < MRBJIT_OPCODE_NUM; i++) {
+    if (stats->abort_op[i]) {
+      mrb_hash_set(mrb, ops, mrb_fixnum_value(i), mrb_fixnum_value(stats->abort_op[i]));
+    }
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "abort_ops")), ops);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "code_size")),
+	       mrb_fixnum_value(stats->code_size));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "code_capa")),
+	       mrb_fixnum_value(mrb->compile_info.code_capa));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "flush_count")),
+	       mrb_fixnum_value(mrb->compile_info.flush_count));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "compile_time")),
+	       mrb_float_value(mrb, stats->compile_time));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "side_exits")),
+	       mrb_fixnum_value(stats->side_exits));
+
+  for (irep = mrb->compile_info.irep_list; irep; irep = irep->jit_next) {
+    for (i = 0; i < irep->jit_exit_stat_num; i++) {
+      const mrbjit_exit_stat *st = irep->jit_exit_stat + i;
+      const char *filename;
+      mrb_value ent[5];
+      int ai;
+
+      kind_count[st->kind] += st->count;
+      ai = mrb_gc_arena_save(mrb);
+      filename = mrb_debug_get_filename(irep, st->pc);
+      ent[0] = filename ? mrb_str_new_cstr(mrb, filename) : mrb_nil_value();
+      ent[1] = mrb_fixnum_value(mrb_debug_get_line(irep, st->pc));
+      ent[2] = mrb_fixnum_value(st->pc);
+      ent[3] = mrb_symbol_value(mrb_intern_cstr(mrb, mrbjit_exit_kind_name[st->kind]));
+      ent[4] = mrb_fixnum_value(st->count);
+      mrb_ary_push(mrb, exits, mrb_ary_new_from_values(mrb, 5, ent));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "exits")), exits);
+
+  for (k = 0; k < MRBJIT_EXIT_KIND_NUM; k++) {
+    mrb_hash_set(mrb, kinds, mrb_symbol_value(mrb_intern_cstr(mrb, mrbjit_exit_kind_name[k])),
+		 mrb_fixnum_value(kind_count[k]));
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "exit_kinds")), kinds);
+
+  return hash;
+}
+
+/*
+ *  call-seq:
+ *     JIT.enable_stats -> true or false
+ *
+ *  Starts measuring :compile_time of JIT.stats. Returns true if it
+ *  was already measured.
+ *
+ */
+
+static mrb_value
+jit_enable_stats(mrb_state *mrb, mrb_value self)
+{
+  int old = mrb->compile_info.stats_enabled;
+
+  mrb->compile_info.stats_enabled = 1;
+  return mrb_bool_value(old);
+}
+
+/*
+ *  call-seq:
+ *     JIT.disable_stats -> true or false
+ *
+ *  Stops measuring :compile_time of JIT.stats. Returns true if it
+ *  was measured.
+ *
+ */
+
+static mrb_value
+jit_disable_stats(mrb_state *mrb, mrb_value self)
+{
+  int old = mrb->compile_info.stats_enabled;
+
+  mrb->compile_info.stats_enabled = 0;
+  return mrb_bool_value(old);
+}
+
+/*
+ *  call-seq:
+ *     JIT.code_limit -> integer
+ *
+ *  Returns bytes the native code cache may grow to.
+ *
+ */
+
+static mrb_value
+jit_code_limit(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mrb->compile_info.code_limit);
+}
+
+/*
+ *  call-seq:
+ *     JIT.code_limit = integer -> integer
+ *
+ *  Sets bytes the native code cache may grow to. The cache grows when
+ *  it is full next time, and it is never shrunk.
+ *
+ */
+
+static mrb_value
+jit_set_code_limit(mrb_state *mrb, mrb_value self)
+{
+  mrb_int limit;
+
+  mrb_get_args(mrb, "i", &limit);
+  if (limit <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "code limit must be positive");
+  }
+  mrb->compile_info.code_limit = limit;
+  return mrb_fixnum_value(limit);
+}
+
+void
+mrb_init_jit(mrb_state *mrb)
+{
+  struct RClass *jit;
+
+  jit = mrb_define_module(mrb, "JIT");
+
+  mrb_define_class_method(mrb, jit, "stats", jit_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, jit, "enable_stats", jit_enable_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, jit, "disable_stats", jit_disable_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, jit, "code_limit", jit_code_limit, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, jit, "code_limit=", jit_set_code_limit, MRB_ARGS_REQ(1));
+}
+
 void
 disasm_once(mrb_state *mrb, mrb_irep *irep, mrb_code c)
 {
@@ -1,19 +1,167 @@
 #include "jitcode.h"
+#include <time.h>
+#if defined(MRBJIT_PERF_MAP) || defined(MRBJIT_DUMP_TRACE)
+#include <stdio.h>
+#include "mruby/debug.h"
+#endif
+#ifdef MRBJIT_PERF_MAP
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 extern "C" {
 
+#ifdef MRBJIT_PERF_MAP
+/* /tmp/perf-<pid>.map is one file of the process. States of all
+   threads append to it under perf_map_lock */
+static pthread_once_t perf_map_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t perf_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *perf_map_fp = NULL;
+
+static void
+mrbjit_perf_map_open(void)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  perf_map_fp = fopen(path, "w");
+}
+
+/* Append the trace to /tmp/perf-<pid>.map. The trace is named by
+   filename, line and offset of its first instruction */
+static void
+mrbjit_perf_map(mrb_state *mrb, const void *end)
+{
+  mrb_irep *irep = mrb->compile_info.trace_irep;
+  const unsigned char *entry = (const unsigned char *)mrb->compile_info.trace_entry;
+  uint32_t pc = mrb->compile_info.trace_pc - irep->iseq;
+  const char *filename = mrb_debug_get_filename(irep, pc);
+
+  pthread_once(&perf_map_once, mrbjit_perf_map_open);
+  if (perf_map_fp == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&perf_map_lock);
+  fprintf(perf_map_fp, "%lx %lx mruby:%s:%d@%u\n",
+	  (unsigned long)entry,
+	  (unsigned long)((const unsigned char *)end - entry),
+	  filename ? filename : "-", mrb_debug_get_line(irep, pc), pc);
+  fflush(perf_map_fp);
+  pthread_mutex_unlock(&perf_map_lock);
+}
+#endif
+
+#ifdef MRBJIT_DUMP_TRACE
+extern void disasm_once(mrb_state *, mrb_irep *, mrb_code);
+
+/* Print native code from start to end in hex. Feed it to
+   "objdump -D -b binary -m i386:x86-64" to disassemble */
+static void
+mrbjit_dump_code(const void *start, const void *end)
+{
+  const unsigned char *p;
+  int n = 0;
+
+  for (p = (const unsigned char *)start; p < (const unsigned char *)end; p++, n++) {
+    if (n % 16 == 0) {
+      printf("%s      %p:", (n == 0) ? "" : "\n", p);
+    }
+    printf(" %02x", *p);
+  }
+  if (n) {
+    printf("\n");
+  }
+}
+
+/* Print the trace being compiled */
+static void
+mrbjit_dump_trace_start(mrb_state *mrb)
+{
+  mrb_irep *irep = mrb->compile_info.trace_irep;
+  uint32_t pc = mrb->compile_info.trace_pc - irep->iseq;
+  const char *filename = mrb_debug_get_filename(irep, pc);
+
+  printf("trace %s:%d@%x entry %p\n", filename ? filename : "-",
+	 mrb_debug_get_line(irep, pc), pc, mrb->compile_info.trace_entry);
+}
+
+/* Print instruction at pc in the format of codedump */
+static void
+mrbjit_dump_insn(mrb_state *mrb, mrb_irep *irep, mrb_code *pc)
+{
+  printf("%4x ", (int)(pc - irep->iseq));
+  disasm_once(mrb, irep, *pc);
+}
+#endif
+
+/* Native code of the trace ends at end. end is NULL if the trace is
+   lost */
+static void
+mrbjit_trace_end(mrb_state *mrb, const void *end)
+{
+#ifdef MRBJIT_PERF_MAP
+  if (mrb->compile_info.trace_entry && end) {
+    mrbjit_perf_map(mrb, end);
+  }
+#endif
+#ifdef MRBJIT_DUMP_TRACE
+  if (mrb->compile_info.trace_entry) {
+    if (end) {
+      printf("end %p size %d\n\n", end,
+	     (int)((const unsigned char *)end -
+		   (const unsigned char *)mrb->compile_info.trace_entry));
+    }
+    else {
+      printf("lost\n\n");
+    }
+  }
+#endif
+  mrb->compile_info.trace_entry = NULL;
+}
+
 void
 mrbjit_gen_exit(mrbjit_code_area coderaw, mrb_state *mrb, mrb_irep *irep, mrb_code **ppc, mrbjit_vmstatus *status)
 {
   MRBJitCode *code = (MRBJitCode *) coderaw;
+#ifdef MRBJIT_DUMP_TRACE
+  const void *start = code->getCurr();
+#endif
+  code->gen_cmp_flush();
   code->gen_exit(*ppc, 1, 0, status);
+#ifdef MRBJIT_DUMP_TRACE
+  mrbjit_dump_code(start, code->getCurr());
+#endif
+  mrbjit_trace_end(mrb, code->getCurr());
 }
 
 void
-mrbjit_gen_jump_block(mrbjit_code_area coderaw, void *entry)
+mrbjit_gen_jump_block(mrb_state *mrb, mrbjit_code_area coderaw, void *entry)
 {
   MRBJitCode *code = (MRBJitCode *) coderaw;
+#ifdef MRBJIT_DUMP_TRACE
+  const void *start = code->getCurr();
+#endif
+  code->gen_cmp_flush();
   code->gen_jump_block(entry);
+#ifdef MRBJIT_DUMP_TRACE
+  printf("      jump %p\n", entry);
+  mrbjit_dump_code(start, code->getCurr());
+#endif
+  mrbjit_trace_end(mrb, code->getCurr());
+}
+
+void *
+mrbjit_jump_entry(mrb_state *mrb, mrb_irep *irep, mrb_code *pc, mrbjit_code_info *ci, mrbjit_code_info *coi)
+{
+  MRBJitCode *code = (MRBJitCode *) mrb->compile_info.code_area;
+  return code->jump_entry(irep, pc, ci, coi);
+}
+
+size_t
+mrbjit_code_size(mrbjit_code_area coderaw)
+{
+  MRBJitCode *code = (MRBJitCode *) coderaw;
+  return code->getSize();
 }
 
 const void *
@@ -23,47 +171,89 @@ mrbjit_get_curr(mrbjit_code_area coderaw)
   return code->getCurr();
 }
 
-static MRBJitCode *the_code = new MRBJitCode();
+/* Code area owned by each mrb_state. Allocated in mrb_open and
+   replaced by larger one in mrbjit_flush_code */
+mrbjit_code_area
+mrbjit_alloc_code(size_t size)
+{
+  try {
+    return (mrbjit_code_area) new MRBJitCode(size);
+  }
+  catch (...) {
+    return NULL;
+  }
+}
 
 void
-mrbjit_gen_jmp_patch(mrbjit_code_area coderaw, void *dst, void *target)
+mrbjit_free_code(mrbjit_code_area coderaw)
 {
-  MRBJitCode *code;
-  if (coderaw == NULL) {
-    code = the_code;
-  } 
-  else {
-    code  = (MRBJitCode *) coderaw;
-  }
-  code->gen_jmp_patch(dst, target);
+  delete (MRBJitCode *) coderaw;
 }
 
 void
-mrbjit_gen_exit_patch(mrbjit_code_area coderaw, void *dst, mrb_code *pc, mrbjit_vmstatus *status)
+mrbjit_gen_jmp_patch(mrb_state *mrb, void *dst, void *target)
 {
-  MRBJitCode *code;
-  if (coderaw == NULL) {
-    code = the_code;
-  } 
-  else {
-    code  = (MRBJitCode *) coderaw;
-  }
-  code->gen_exit_patch(dst, pc, status);
+  MRBJitCode *code = (MRBJitCode *) mrb->compile_info.code_area;
+  code->gen_jmp_patch(dst, target);
 }
 
 void
-mrbjit_gen_align(mrbjit_code_area coderaw, unsigned align)
+mrbjit_gen_align(mrb_state *mrb, unsigned align)
 {
-  MRBJitCode *code;
-  if (coderaw == NULL) {
-    code = the_code;
-  } 
-  else {
-    code  = (MRBJitCode *) coderaw;
-  }
+  MRBJitCode *code = (MRBJitCode *) mrb->compile_info.code_area;
   code->gen_align(align);
 }
 
+#ifdef XBYAK64
+void *
+mrbjit_enter_trace(mrb_state *mrb, mrbjit_vmstatus *status, void *entry, void **prev_entry)
+{
+  MRBJitCode *code = (MRBJitCode *) mrb->compile_info.code_area;
+  return code->entry_trampoline(*status->regs, status->pc, mrb, mrb->c,
+				entry, prev_entry);
+}
+#endif
+
+/* Instructions which keep register cache of MRBJitCode */
+static int
+mrbjit_regcache_aware_p(mrb_state *mrb, mrb_code i)
+{
+  if (mrb->code_fetch_hook) {
+    return 0;
+  }
+
+  switch(GET_OPCODE(i)) {
+  case OP_NOP:
+  case OP_MOVE:
+  case OP_LOADL:
+  case OP_LOADI:
+  case OP_LOADSELF:
+  case OP_LOADT:
+  case OP_LOADF:
+  case OP_LOADNIL:
+  case OP_ADD:
+  case OP_ADDI:
+  case OP_SUB:
+  case OP_SUBI:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_EQ:
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_JMP:
+  case OP_JMPIF:
+  case OP_JMPNOT:
+  case OP_ONERR:
+  case OP_POPERR:
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
 static const void *
 mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
 		     MRBJitCode *code, mrbjit_code_info *coi)
@@ -71,17 +261,55 @@ mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
   mrb_value *regs = *status->regs;
   mrb_code **ppc = status->pc;
   const void *rc;
+  const void *cache_entry = NULL;
+  const void *loop_head = NULL;
 
   if (code == NULL) {
-    code = the_code;
+    code = (MRBJitCode *) mrb->compile_info.code_area;
     //    printf("%x \n", code->getCurr());
     mrb->compile_info.code_base = code;
+    code->regcache_clear();
+    code->cmp_pending_clear();
+    code->inline_clear(mrb);
+    mrb->compile_info.trace_entry = (void *)code->getCurr();
+    mrb->compile_info.trace_irep = *status->irep;
+    mrb->compile_info.trace_pc = *ppc;
+#ifdef MRBJIT_DUMP_TRACE
+    mrbjit_dump_trace_start(mrb);
+#endif
+  }
+  if (!code->inline_op_p(**ppc, regs)) {
+    /* End trace. Callinfo of inlined method is made at the exit */
+    return NULL;
+  }
+#ifdef MRBJIT_DUMP_TRACE
+  mrbjit_dump_insn(mrb, *status->irep, *ppc);
+#endif
+  if (!code->cmp_pending_used_p(**ppc)) {
+    /* Before entry, because it is kept if this instruction fails */
+    code->gen_cmp_flush();
   }
   const void *entry = code->gen_entry(mrb, status);
 
+  code->set_pic_num(coi);
+
+  coi->loop_entry = NULL;
   if (mrb->code_fetch_hook) {
     code->gen_call_fetch_hook(mrb, status);
   }
+  else if (!code->cmp_pending_used_p(**ppc)) {
+    loop_head = code->gen_loop_preheader(mrb, status, coi);
+  }
+
+  if (code->cmp_pending_used_p(**ppc)) {
+    /* Jump instruction makes its own entry */
+  }
+  else if (mrbjit_regcache_aware_p(mrb, **ppc)) {
+    cache_entry = code->gen_regcache_entry();
+  }
+  else {
+    code->regcache_clear();
+  }
 
   switch(GET_OPCODE(**ppc)) {
   case OP_NOP:
@@ -141,6 +369,34 @@ mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
     rc =code->emit_getconst(mrb, status, coi);
     break;
 
+  case OP_GETMCNST:
+    rc =code->emit_getmcnst(mrb, status, coi);
+    break;
+
+  case OP_ONERR:
+    rc =code->emit_onerr(mrb, status, coi);
+    break;
+
+  case OP_POPERR:
+    rc =code->emit_poperr(mrb, status, coi);
+    break;
+
+  case OP_RAISE:
+    rc =code->emit_raise(mrb, status, coi);
+    break;
+
+  case OP_RESCUE:
+    rc =code->emit_rescue(mrb, status, coi);
+    break;
+
+  case OP_EPUSH:
+    rc =code->emit_epush(mrb, status, coi);
+    break;
+
+  case OP_EPOP:
+    rc =code->emit_epop(mrb, status, coi);
+    break;
+
   case OP_SENDB:
   case OP_SEND:
     rc =code->emit_send(mrb, status, coi);
@@ -157,7 +413,10 @@ mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
 
   case OP_RETURN:
     mrb->compile_info.nest_level--;
-    if (mrb->c->ci->proc->env ||
+    if (code->inline_p()) {
+      rc =code->emit_return_elided(mrb, status);
+    }
+    else if (mrb->c->ci->proc->env ||
 	mrb->compile_info.nest_level < 0) {
       rc =code->emit_return(mrb, status);
     }
@@ -213,6 +472,18 @@ mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
   case OP_ARRAY:
     rc =code->emit_array(mrb, status, coi, regs);
     break;
+
+  case OP_STRING:
+    rc =code->emit_string(mrb, status, coi);
+    break;
+
+  case OP_STRCAT:
+    rc =code->emit_strcat(mrb, status, coi);
+    break;
+
+  case OP_HASH:
+    rc =code->emit_hash(mrb, status, coi);
+    break;
     
   case OP_GETUPVAR:
     rc =code->emit_getupvar(mrb, status, coi);
@@ -251,25 +522,115 @@ mrbjit_emit_code_aux(mrb_state *mrb, mrbjit_vmstatus *status,
   if (rc == NULL) {
     /* delete fetch hook */
     code->set_entry(entry);
+    mrbjit_drop_dependency(mrb, entry);
+    coi->loop_entry = NULL;
+    mrb->compile_info.stats.aborts++;
+    mrb->compile_info.stats.abort_op[GET_OPCODE(**ppc)]++;
+  }
+  else if (loop_head) {
+    rc = loop_head;
+  }
+  else if (cache_entry) {
+    rc = cache_entry;
   }
+#ifdef MRBJIT_DUMP_TRACE
+  if (rc) {
+    mrbjit_dump_code(entry, code->getCurr());
+  }
+  else {
+    printf("      (not compiled)\n");
+  }
+#endif
 
   return rc;
 }
 
+/* CPU time of the calling thread in seconds. Other threads and
+   states don't count in compile_time */
+static double
+mrbjit_thread_time(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Flush code cache. VM runs by interpreter until traces become hot
+   again. The cache is replaced by one twice as large until it reaches
+   code_limit, after that JIT is disabled if the cache thrashes.
+   Flush must not happen while native code is on the C stack, because
+   it returns to the code overwritten or freed. Trace is recorded only
+   when disable_jit is 0, so every callout from native code which may
+   run Ruby code sets disable_jit while it runs (see mrbjit_exec_send_c) */
+static void
+mrbjit_flush_code(mrb_state *mrb, MRBJitCode *code)
+{
+  mrbjit_comp_info *cinfo = &mrb->compile_info;
+  mrbjit_code_area area = NULL;
+  size_t size = cinfo->code_capa * 2;
+
+  if (size > cinfo->code_limit) {
+    size = cinfo->code_limit;
+  }
+  if (size > cinfo->code_capa) {
+    area = mrbjit_alloc_code(size);
+  }
+  if (area) {
+    mrbjit_free_code(cinfo->code_area);
+    cinfo->code_area = area;
+    cinfo->code_capa = size;
+  }
+  else {
+    code->init_code();
+    if (++cinfo->thrash_count > MRBJIT_MAX_FLUSH) {
+      cinfo->disable_jit = 1;
+    }
+  }
+  cinfo->flush_count++;
+  mrbjit_trace_end(mrb, NULL);
+  mrbjit_reset_code_info(mrb);
+}
+
 const void *
 mrbjit_emit_code(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
 {
   MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+  mrbjit_stats *stats = &mrb->compile_info.stats;
+  double start = 0.0;
   const void *rc;
+
+  if (mrb->compile_info.stats_enabled) {
+    start = mrbjit_thread_time();
+  }
   try {
     rc = mrbjit_emit_code_aux(mrb, status, code, coi);
   }
   catch(Xbyak::Error err) {
-    printf("Xbyak error %d \n", int(err));
-    exit(1);
+    /* Code cache is full (or broken by the error). Trace under
+       construction is lost with all others */
+    mrbjit_flush_code(mrb, (MRBJitCode *) mrb->compile_info.code_area);
+    rc = NULL;
+  }
+  if (code == NULL && rc) {
+    stats->traces++;
   }
   if (rc == NULL && code == NULL) {
+    /* No trace */
     mrb->compile_info.code_base = NULL;
+    mrbjit_trace_end(mrb, NULL);
+  }
+  else if (mrb->compile_info.code_base == NULL) {
+    /* Trace is closed by jump */
+    MRBJitCode *area = (MRBJitCode *) mrb->compile_info.code_area;
+    mrbjit_trace_end(mrb, area->getCurr());
+  }
+  if (mrb->compile_info.stats_enabled) {
+    stats->compile_time += mrbjit_thread_time() - start;
   }
 
   return rc;
@@ -8,6 +8,7 @@
 #define MRUBY_JITCODE_H
 
 #include <xbyak/xbyak.h>
+#include <string.h>
 extern "C" {
 #include "mruby.h"
 #include "opcode.h"
@@ -18,7 +19,9 @@ extern "C" {
 #include "mruby/proc.h"
 #include "mruby/range.h"
 #include "mruby/array.h"
+#include "mruby/string.h"
 #include "mruby/class.h"
+#include "mruby/gc.h"
 #include "mruby/jit.h"
 
 void *mrbjit_exec_send_c(mrb_state *, mrbjit_vmstatus *, 
@@ -27,33 +30,848 @@ void *mrbjit_exec_extend_callinfo(mrb_state *, mrb_context *, int);
 
 void *mrbjit_exec_send_mruby(mrb_state *, mrbjit_vmstatus *, 
 		      struct RProc *, struct RClass *);
+void *mrbjit_exec_send_mega(mrb_state *, mrbjit_vmstatus *);
 void *mrbjit_exec_enter(mrb_state *, mrbjit_vmstatus *);
 void *mrbjit_exec_return(mrb_state *, mrbjit_vmstatus *);
 void *mrbjit_exec_return_fast(mrb_state *, mrbjit_vmstatus *);
 void *mrbjit_exec_call(mrb_state *, mrbjit_vmstatus *);
+void mrbjit_exec_epush(mrb_state *, mrb_irep *);
+void mrbjit_exec_epop(mrb_state *, int);
+mrb_value mrbjit_exec_string(mrb_state *, mrb_value);
+mrb_value mrbjit_exec_hash(mrb_state *, mrb_value *, int);
+void mrbjit_exec_strcat(mrb_state *, mrb_value, mrb_value);
+uint32_t mrbjit_sym_hash(mrb_state *, mrb_sym);
+mrb_value mrbjit_exec_hash_get(mrb_state *, mrb_value, mrb_value);
+void mrbjit_exec_hash_set(mrb_state *, mrb_value, mrb_value, mrb_value);
 } /* extern "C" */
 
 #define OffsetOf(s_type, field) ((size_t) &((s_type *)0)->field) 
 #define VMSOffsetOf(field) (((intptr_t)status->field) - ((intptr_t)status->pc))
 #define CALL_MAXARGS 127
 
-/* Regs Map                               *
- * ecx   -- pointer to regs               *
- * ebx   -- pointer to status->pc         *
- * esi   -- pointer to mrb                *
- * edi   -- pointer to mrb->c             */
+#ifdef XBYAK64
+#define CALLINFO_SIZE_SHIFT 7	/* log2(sizeof(mrb_callinfo)) */
+#define MRBJIT_TT_SHIFT 14	/* see mrb_mktt in mruby/value.h */
+#else
+#define CALLINFO_SIZE_SHIFT 6
+#define MRBJIT_TT_SHIFT 0
+#endif
+
+/* Tag of mrb_value is loaded from offset 4 and values are copied by
+   movsd */
+static_assert(sizeof(mrb_value) == 8, "mrb_value must be NaN-boxed in 8 bytes");
+static_assert(sizeof(mrb_callinfo) == (1 << CALLINFO_SIZE_SHIFT),
+	      "mrb_callinfo must be 1 << CALLINFO_SIZE_SHIFT bytes");
+
+/* Register cache uses xmm2 - xmm7 */
+#define REGCACHE_BASE 2
+#define REGCACHE_NUM 6
+
+/* Condition left in flags by comparison. Negation of cc is cc ^ 1 */
+enum mrbjit_cc {
+  MRBJIT_CC_Z, MRBJIT_CC_NZ,
+  MRBJIT_CC_L, MRBJIT_CC_GE,
+  MRBJIT_CC_LE, MRBJIT_CC_G,
+  MRBJIT_CC_B, MRBJIT_CC_AE,
+  MRBJIT_CC_BE, MRBJIT_CC_A,
+};
+
+/* Rounding of Float to Fixnum (see gen_flo_to_fix) */
+enum mrbjit_flo_round {
+  MRBJIT_FLO_TRUNCATE, MRBJIT_FLO_FLOOR,
+  MRBJIT_FLO_CEIL, MRBJIT_FLO_ROUND,
+};
+
+/* Regs Map                                      *
+ *          x86     x86-64                       *
+ * regs     ecx     r12  -- pointer to regs      *
+ * vms      ebx     rbx  -- pointer to status->pc *
+ * mrb      esi     r13  -- pointer to mrb       *
+ * context  edi     r14  -- pointer to mrb->c    *
+ * tmp0     eax     rax                          *
+ * tmp1     edx     rdx                          *
+ * x86-64 uses callee saved registers for the map, so C functions
+ * can be called without saving them. r11 is used as scratch.
+ * rsp is 16 byte aligned in trace code on x86-64.  */
 class MRBJitCode: public Xbyak::CodeGenerator {
 
   void *addr_call_extend_callinfo;
   void *addr_call_stack_extend;
 
+  int regcache[REGCACHE_NUM];	/* VM register number or -1 */
+  int regcache_victim;
+
+  /* Method inlined without callinfo (see emit_send_inline) */
+  mrb_code *inline_pc;		/* pc of the send or NULL */
+  struct RProc *inline_proc;
+  struct RClass *inline_class;
+
+  /* Comparison whose result is only in flags (see COMP_GEN) */
+  int cmp_pending_regno;	/* VM register number or -1 */
+  enum mrbjit_cc cmp_pending_cc;
+
+  /* Entries of polymorphic inline cache with the branch trace from
+     class guard of the instruction being compiled (see set_pic_num) */
+  int pic_num;
+
  public:
 
- MRBJitCode():
-  CodeGenerator(1024 * 1024)
+  const Xbyak::Reg32e &reg_regs;
+  const Xbyak::Reg32e &reg_vms;
+  const Xbyak::Reg32e &reg_mrb;
+  const Xbyak::Reg32e &reg_context;
+  const Xbyak::Reg32e &reg_tmp0;
+  const Xbyak::Reg32e &reg_tmp1;
+  const Xbyak::Reg32e &reg_sp;
+  const Xbyak::AddressFrame &pword;   /* Pointer size address */
+
+#ifdef XBYAK64
+  typedef void *(*trampoline_t)(mrb_value *, mrb_code **, mrb_state *,
+				struct mrb_context *, void *, void **);
+  trampoline_t entry_trampoline;
+#endif
+
+ MRBJitCode(size_t size):
+  CodeGenerator(size),
+#ifdef XBYAK64
+    reg_regs(r12), reg_vms(rbx), reg_mrb(r13), reg_context(r14),
+    reg_tmp0(rax), reg_tmp1(rdx), reg_sp(rsp), pword(qword)
+#else
+    reg_regs(ecx), reg_vms(ebx), reg_mrb(esi), reg_context(edi),
+    reg_tmp0(eax), reg_tmp1(edx), reg_sp(esp), pword(dword)
+#endif
   {
+    init_code();
+  }
+
+  /* Discard all generated code and regenerate common stubs */
+  void
+    init_code()
+  {
+    reset();
     addr_call_extend_callinfo = NULL;
     addr_call_stack_extend = NULL;
+    regcache_clear();
+    cmp_pending_regno = -1;
+    inline_pc = NULL;
+    pic_num = 0;
+#ifdef XBYAK64
+    entry_trampoline = (trampoline_t)gen_entry_trampoline();
+#endif
+  }
+
+#ifdef XBYAK64
+  /* Entry of native code from mrbjit_dispatch.
+     trampoline(regs, status->pc, mrb, mrb->c, entry, &prev_entry)
+     Set up Regs Map from SysV arguments and call entry. Return value
+     of trace (eax) is returned, exit position (edx) is stored to
+     prev_entry.  */
+  const void *
+    gen_entry_trampoline()
+  {
+    const void *code = getCurr();
+
+    push(rbx);
+    push(rbp);
+    push(r12);
+    push(r13);
+    push(r14);
+    push(r15);
+    push(r9);			/* &prev_entry */
+    sub(rsp, 8);		/* rsp is 16 byte aligned in trace */
+    mov(r12, rdi);
+    mov(rbx, rsi);
+    mov(r13, rdx);
+    mov(r14, rcx);
+    call(r8);
+    add(rsp, 8);
+    pop(r9);
+    mov(ptr [r9], rdx);
+    pop(r15);
+    pop(r14);
+    pop(r13);
+    pop(r12);
+    pop(rbp);
+    pop(rbx);
+    ret();
+
+    return code;
+  }
+#endif
+
+  /* Store pointer immediate to memory. x86-64 has no 64bit immediate
+     store, so it goes through r11 */
+  void
+    gen_mov_ptr_imm(const Xbyak::Address &dst, const void *p)
+  {
+#ifdef XBYAK64
+    mov(r11, (size_t)p);
+    mov(dst, r11);
+#else
+    mov(dst, (Xbyak::uint32)p);
+#endif
+  }
+
+  /* Load object pointer in mrb_value at src (decode nan boxing) */
+  void
+    gen_load_ptr(const Xbyak::Reg32e &dst, const Xbyak::Address &src)
+  {
+    mov(dst, src);
+#ifdef XBYAK64
+    shl(dst, 18);
+    shr(dst, 16);
+#endif
+  }
+
+  /* Call C function. x86-64 calls through register because the function
+     may be out of range of rel32 */
+  void
+    gen_call(const void *func)
+  {
+#ifdef XBYAK64
+    mov(r11, (size_t)func);
+    call(r11);
+#else
+    call(func);
+#endif
+  }
+
+  /* Allocate object of class c like mrb_obj_alloc. Pointer is
+     returned in reg_tmp0. Free object is taken from the free list of
+     the page inline. mrb_obj_alloc is called when a GC step is due,
+     the arena is full or the page would become empty (it must be
+     unlinked from free_heaps).
+     destroy reg_tmp1, xmm0 (and r11 of x86-64) */
+  void
+    gen_alloc_object(mrb_state *mrb, enum mrb_vtype tt, struct RClass *c)
+  {
+    const mrb_gc_alloc_layout *layout = &mrb_gc_alloc_layout_info;
+    size_t off;
+
+    inLocalLabel();
+#ifndef MRB_GC_STRESS
+    mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, live)]);
+    cmp(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, gc_threshold)]);
+    ja(".slow", T_NEAR);
+    mov(eax, dword [reg_mrb + OffsetOf(mrb_state, arena_idx)]);
+#ifdef MRB_GC_FIXED_ARENA
+    cmp(eax, MRB_GC_ARENA_SIZE);
+#else
+    cmp(eax, dword [reg_mrb + OffsetOf(mrb_state, arena_capa)]);
+#endif
+    jge(".slow", T_NEAR);
+
+    mov(reg_tmp1, ptr [reg_mrb + OffsetOf(mrb_state, free_heaps)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".slow", T_NEAR);
+    /* Linked page has at least one free object */
+    mov(reg_tmp0, ptr [reg_tmp1 + layout->freelist]);
+#ifdef XBYAK64
+    mov(r11, ptr [reg_tmp0 + layout->next]);
+    test(r11, r11);
+    jz(".slow", T_NEAR);
+    mov(ptr [reg_tmp1 + layout->freelist], r11);
+#else
+    cmp(dword [reg_tmp0 + layout->next], 0);
+    jz(".slow", T_NEAR);
+    push(dword [reg_tmp0 + layout->next]);
+    pop(dword [reg_tmp1 + layout->freelist]);
+#endif
+
+    /* mrb->live++; gc_protect(mrb, p); */
+    add(pword [reg_mrb + OffsetOf(mrb_state, live)], 1);
+    mov(edx, dword [reg_mrb + OffsetOf(mrb_state, arena_idx)]);
+    inc(dword [reg_mrb + OffsetOf(mrb_state, arena_idx)]);
+#ifdef MRB_GC_FIXED_ARENA
+    mov(ptr [reg_mrb + OffsetOf(mrb_state, arena) + reg_tmp1 * sizeof(void *)], reg_tmp0);
+#elif defined(XBYAK64)
+    mov(r11, ptr [reg_mrb + OffsetOf(mrb_state, arena)]);
+    mov(ptr [r11 + reg_tmp1 * sizeof(void *)], reg_tmp0);
+#else
+    shl(edx, 2);
+    add(edx, dword [reg_mrb + OffsetOf(mrb_state, arena)]);
+    mov(ptr [edx], reg_tmp0);
+#endif
+
+    /* Clear the slot, then tt, color and class */
+    xorps(xmm0, xmm0);
+    for (off = 0; off + 16 <= layout->size; off += 16) {
+      movups(ptr [reg_tmp0 + off], xmm0);
+    }
+    if (off < layout->size) {
+      movsd(ptr [reg_tmp0 + off], xmm0);
+    }
+    mov(edx, dword [reg_mrb + OffsetOf(mrb_state, current_white_part)]);
+    shl(edx, 8);
+    or(edx, (Xbyak::uint32)tt);
+    mov(dword [reg_tmp0], edx);
+    gen_mov_ptr_imm(pword [reg_tmp0 + OffsetOf(struct RBasic, c)], c);
+    jmp(".done", T_NEAR);
+
+    L(".slow");
+#endif
+#ifdef XBYAK64
+    mov(rdx, (size_t)c);
+    mov(esi, (Xbyak::uint32)tt);
+    mov(rdi, reg_mrb);
+    gen_call((void *)mrb_obj_alloc);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push((Xbyak::uint32)c);
+    push((Xbyak::uint32)tt);
+    push(reg_mrb);
+    call((void *)mrb_obj_alloc);
+    add(reg_sp, 3 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+    L(".done");
+    outLocalLabel();
+  }
+
+  /* Write barrier for storing value of vinfo to object in regs at
+     objoff. Nothing is needed for immediate values, and
+     mrb_write_barrier is called only when the object is black. The
+     object is left in reg_tmp0.
+     destroy reg_tmp1 and caller saved registers */
+  void
+    gen_write_barrier(int objoff, mrbjit_reginfo *vinfo)
+  {
+    gen_load_ptr(reg_tmp0, ptr [reg_regs + objoff]);
+    switch (vinfo->type) {
+    case MRB_TT_FALSE:
+    case MRB_TT_TRUE:
+    case MRB_TT_FIXNUM:
+    case MRB_TT_SYMBOL:
+    case MRB_TT_FLOAT:
+      return;
+
+    default:
+      break;
+    }
+
+    /* color is bit 8-10 of the object header */
+    test(byte [reg_tmp0 + 1], MRB_GC_BLACK);
+    jz("@f");
+#ifdef XBYAK64
+    mov(rsi, reg_tmp0);
+    mov(rdi, reg_mrb);
+    gen_call((void *)mrb_write_barrier);
+    gen_load_ptr(reg_tmp0, ptr [reg_regs + objoff]);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push(eax);
+    push(reg_mrb);
+    call((void *)mrb_write_barrier);
+    add(reg_sp, 4);
+    pop(eax);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+    L("@@");
+  }
+
+  /* Store mrb_value returned by C function to regs */
+  void
+    gen_store_cret(int dstoff)
+  {
+#ifdef XBYAK64
+    mov(qword [reg_regs + dstoff], rax);
+#else
+    mov(dword [reg_regs + dstoff], eax);
+    mov(dword [reg_regs + dstoff + 4], edx);
+#endif
+  }
+
+  /* Store object pointer in src as mrb_value of type tt to regs.
+     x86-64 NaN boxing keeps pointer >> 2 beside type tag */
+  void
+    gen_store_ptr_value(int dstoff, const Xbyak::Reg32e &src, enum mrb_vtype tt)
+  {
+#ifdef XBYAK64
+    mov(r11, src);
+    shr(r11, 2);
+    mov(qword [reg_regs + dstoff], r11);
+    or(dword [reg_regs + dstoff + 4], mrb_mktt(tt));
+#else
+    mov(dword [reg_regs + dstoff], src);
+    mov(dword [reg_regs + dstoff + 4], mrb_mktt(tt));
+#endif
+  }
+
+  /* Register cache
+     Float values of VM registers are kept in xmm2 - xmm7 while a trace
+     runs straight, and arithmetic and comparison read them without
+     memory access. VM registers in memory are always written too
+     (write through), so side exits need no spill. Instructions which
+     don't know the cache clear it (see mrbjit_emit_code_aux). An
+     instruction entered from outside of the trace reloads the cache
+     in the stub made by gen_regcache_entry.
+     This is not register allocation. The trace is compiled an
+     instruction at a time while it runs, so there is no liveness or
+     linear scan over it, and replacement is round robin. Only Floats
+     are cached; Fixnum operands are loaded from and stored to memory
+     on every instruction although r8 - r10 (and r15 if saved) are
+     free on x86-64.  */
+  void
+    regcache_clear()
+  {
+    int i;
+
+    for (i = 0; i < REGCACHE_NUM; i++) {
+      regcache[i] = -1;
+    }
+    regcache_victim = 0;
+  }
+
+  int
+    regcache_find(int regno)
+  {
+    int i;
+
+    for (i = 0; i < REGCACHE_NUM; i++) {
+      if (regcache[i] == regno) {
+	return i;
+      }
+    }
+    return -1;
+  }
+
+  void
+    regcache_invalidate(int regno)
+  {
+    int i = regcache_find(regno);
+
+    if (i >= 0) {
+      regcache[i] = -1;
+    }
+  }
+
+  Xbyak::Xmm
+    regcache_xmm(int i)
+  {
+    return Xbyak::Xmm(REGCACHE_BASE + i);
+  }
+
+  /* Load VM register regno to dst from cache or memory */
+  void
+    gen_regcache_load(const Xbyak::Xmm &dst, int regno)
+  {
+    int i = regcache_find(regno);
+
+    if (i >= 0) {
+      movapd(dst, regcache_xmm(i));
+    }
+    else {
+      movsd(dst, ptr [reg_regs + regno * sizeof(mrb_value)]);
+    }
+  }
+
+  /* Store src to VM register regno and keep it in cache */
+  void
+    gen_regcache_store(int regno, const Xbyak::Xmm &src)
+  {
+    int i = regcache_find(regno);
+
+    movsd(ptr [reg_regs + regno * sizeof(mrb_value)], src);
+    if (i < 0) {
+      for (i = 0; i < REGCACHE_NUM; i++) {
+	if (regcache[i] < 0) {
+	  break;
+	}
+      }
+      if (i == REGCACHE_NUM) {
+	i = regcache_victim;
+	regcache_victim = (regcache_victim + 1) % REGCACHE_NUM;
+      }
+      regcache[i] = regno;
+    }
+    movapd(regcache_xmm(i), src);
+  }
+
+  /* Load all cached VM registers from memory */
+  void
+    gen_regcache_reload()
+  {
+    int i;
+
+    for (i = 0; i < REGCACHE_NUM; i++) {
+      if (regcache[i] >= 0) {
+	movsd(regcache_xmm(i), ptr [reg_regs + regcache[i] * sizeof(mrb_value)]);
+      }
+    }
+  }
+
+  /* Entry of instruction which uses register cache. Code of the trace
+     jumps over the stub, and other code enters the stub and loads
+     cached VM registers from memory. Return the entry address or NULL
+     if the cache is empty */
+  const void *
+    gen_regcache_entry()
+  {
+    const void *entry;
+    int i;
+
+    for (i = 0; i < REGCACHE_NUM; i++) {
+      if (regcache[i] >= 0) {
+	break;
+      }
+    }
+    if (i == REGCACHE_NUM) {
+      return NULL;
+    }
+
+    inLocalLabel();
+    jmp(".body");
+    entry = getCurr();
+    gen_regcache_reload();
+    L(".body");
+    outLocalLabel();
+
+    return entry;
+  }
+
+  void
+    gen_setcc(enum mrbjit_cc cc, const Xbyak::Reg8 &r)
+  {
+    switch(cc) {
+    case MRBJIT_CC_Z:  setz(r);  break;
+    case MRBJIT_CC_NZ: setnz(r); break;
+    case MRBJIT_CC_L:  setl(r);  break;
+    case MRBJIT_CC_GE: setge(r); break;
+    case MRBJIT_CC_LE: setle(r); break;
+    case MRBJIT_CC_G:  setg(r);  break;
+    case MRBJIT_CC_B:  setb(r);  break;
+    case MRBJIT_CC_AE: setae(r); break;
+    case MRBJIT_CC_BE: setbe(r); break;
+    case MRBJIT_CC_A:  seta(r);  break;
+    }
+  }
+
+  void
+    gen_jcc(enum mrbjit_cc cc, const char *label)
+  {
+    switch(cc) {
+    case MRBJIT_CC_Z:  jz(label);  break;
+    case MRBJIT_CC_NZ: jnz(label); break;
+    case MRBJIT_CC_L:  jl(label);  break;
+    case MRBJIT_CC_GE: jge(label); break;
+    case MRBJIT_CC_LE: jle(label); break;
+    case MRBJIT_CC_G:  jg(label);  break;
+    case MRBJIT_CC_B:  jb(label);  break;
+    case MRBJIT_CC_AE: jae(label); break;
+    case MRBJIT_CC_BE: jbe(label); break;
+    case MRBJIT_CC_A:  ja(label);  break;
+    }
+  }
+
+  /* Store true or false to VM register regno by condition in flags */
+  void
+    gen_bool_value(enum mrbjit_cc cc, int regno)
+  {
+    const Xbyak::uint32 off = regno * sizeof(mrb_value);
+
+    gen_setcc(cc, al);
+    movzx(eax, al);
+    shl(eax, MRBJIT_TT_SHIFT + 1);
+    or(eax, mrb_mktt(MRB_TT_FALSE));
+    mov(dword [reg_regs + off + 4], eax);
+    mov(dword [reg_regs + off], 1);
+  }
+
+  /* Comparison at pc can leave result in flags only if the next
+     instruction is conditional jump by the result */
+  int
+    cmp_fusible_p(mrb_state *mrb, mrb_code *pc)
+  {
+    mrb_code i = pc[1];
+
+    if (mrb->code_fetch_hook) {
+      return 0;
+    }
+    switch(GET_OPCODE(*pc)) {
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+      break;
+
+    default:
+      return 0;
+    }
+
+    return (GET_OPCODE(i) == OP_JMPIF || GET_OPCODE(i) == OP_JMPNOT) &&
+      GETARG_A(i) == GETARG_A(*pc);
+  }
+
+  /* Return true if instruction i uses pending comparison */
+  int
+    cmp_pending_used_p(mrb_code i)
+  {
+    return cmp_pending_regno >= 0 &&
+      (GET_OPCODE(i) == OP_JMPIF || GET_OPCODE(i) == OP_JMPNOT) &&
+      GETARG_A(i) == cmp_pending_regno;
+  }
+
+  void
+    cmp_pending_clear()
+  {
+    cmp_pending_regno = -1;
+  }
+
+  /* Make boolean of pending comparison. Flags must be kept from the
+     comparison */
+  void
+    gen_cmp_flush()
+  {
+    if (cmp_pending_regno >= 0) {
+      gen_bool_value(cmp_pending_cc, cmp_pending_regno);
+      cmp_pending_regno = -1;
+    }
+  }
+
+  /* Return true if value of temporary VM register regno is overwritten
+     before read in straight code from pc. Scan only a few
+     instructions and answer false when unsure */
+  int
+    reg_dead_p(mrb_irep *irep, mrb_code *pc, int regno)
+  {
+    int i;
+
+    if (regno < irep->nlocals) {
+      return 0;
+    }
+    for (i = 0; i < 8 && pc < irep->iseq + irep->ilen; i++, pc++) {
+      switch(GET_OPCODE(*pc)) {
+      case OP_NOP:
+	break;
+
+      case OP_MOVE:
+	if (GETARG_B(*pc) == regno) {
+	  return 0;
+	}
+	if (GETARG_A(*pc) == regno) {
+	  return 1;
+	}
+	break;
+
+      case OP_LOADL:
+      case OP_LOADI:
+      case OP_LOADSYM:
+      case OP_LOADNIL:
+      case OP_LOADSELF:
+      case OP_LOADT:
+      case OP_LOADF:
+      case OP_GETGLOBAL:
+      case OP_GETIV:
+      case OP_GETCV:
+      case OP_GETCONST:
+      case OP_GETUPVAR:
+	if (GETARG_A(*pc) == regno) {
+	  return 1;
+	}
+	break;
+
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_EQ:
+      case OP_LT:
+      case OP_LE:
+      case OP_GT:
+      case OP_GE:
+	if (GETARG_A(*pc) == regno || GETARG_A(*pc) + 1 == regno) {
+	  return 0;
+	}
+	break;
+
+      case OP_ADDI:
+      case OP_SUBI:
+	if (GETARG_A(*pc) == regno) {
+	  return 0;
+	}
+	break;
+
+      default:
+	return 0;
+      }
+    }
+
+    return 0;
+  }
+
+  /* Return true if VM register regno may be written by instructions
+     from pc to end. Unknown instructions are assumed to write A and
+     registers after it (arguments of method call) */
+  int
+    reg_written_p(mrb_code *pc, mrb_code *end, int regno)
+  {
+    for (; pc <= end; pc++) {
+      switch(GET_OPCODE(*pc)) {
+      case OP_NOP:
+      case OP_JMP:
+      case OP_JMPIF:
+      case OP_JMPNOT:
+      case OP_SETGLOBAL:
+      case OP_SETIV:
+      case OP_SETCV:
+      case OP_SETCONST:
+      case OP_SETUPVAR:
+      case OP_RETURN:
+      case OP_ONERR:
+      case OP_POPERR:
+      case OP_EPUSH:
+      case OP_EPOP:
+	break;
+
+      case OP_MOVE:
+      case OP_LOADL:
+      case OP_LOADI:
+      case OP_LOADSYM:
+      case OP_LOADNIL:
+      case OP_LOADSELF:
+      case OP_LOADT:
+      case OP_LOADF:
+      case OP_GETGLOBAL:
+      case OP_GETIV:
+      case OP_GETCV:
+      case OP_GETCONST:
+      case OP_GETUPVAR:
+      case OP_ADD:
+      case OP_ADDI:
+      case OP_SUB:
+      case OP_SUBI:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_EQ:
+      case OP_LT:
+      case OP_LE:
+      case OP_GT:
+      case OP_GE:
+	if (GETARG_A(*pc) == regno) {
+	  return 1;
+	}
+	break;
+
+      default:
+	if (GETARG_A(*pc) <= regno) {
+	  return 1;
+	}
+	break;
+      }
+    }
+
+    return 0;
+  }
+
+  /* Return the last backward jump to pc, or NULL if pc is not head of
+     a loop. Loops of method which makes closure are ignored because
+     the closure may change local variables */
+  mrb_code *
+    loop_end(mrb_irep *irep, mrb_code *pc)
+  {
+    mrb_code *p;
+    mrb_code *end = NULL;
+
+    for (p = irep->iseq; p < irep->iseq + irep->ilen; p++) {
+      switch(GET_OPCODE(*p)) {
+      case OP_LAMBDA:
+	return NULL;
+
+      case OP_JMP:
+      case OP_JMPIF:
+      case OP_JMPNOT:
+	if (p >= pc && p + GETARG_sBx(*p) == pc) {
+	  end = p;
+	}
+	break;
+      }
+    }
+
+    return end;
+  }
+
+  /* VM register regno is read in the loop from head to end and never
+     written in it */
+  int
+    loop_invariant_p(mrb_code *head, mrb_code *end, int regno)
+  {
+    mrb_code *p;
+
+    for (p = head; p <= end; p++) {
+      if (GET_OPCODE(*p) == OP_MOVE && GETARG_B(*p) == regno) {
+	return !reg_written_p(head, end, regno);
+      }
+    }
+
+    return 0;
+  }
+
+  /* Guard loop invariant VM registers once at the head of the loop.
+     reginfo keeps the types through the loop body, so guards of them
+     in the body are not made. The steady state of the loop enters
+     coi->loop_entry after these guards (see jump_entry).
+     Return the address of the pre-header or NULL if no guard is made */
+  const void *
+    gen_loop_preheader(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    mrb_irep *irep = *status->irep;
+    mrb_code *pc = *status->pc;
+    mrb_code *end = loop_end(irep, pc);
+    const void *head = getCurr();
+    int i;
+
+    if (end == NULL) {
+      return NULL;
+    }
+
+    for (i = 0; i < irep->nregs; i++) {
+      if (loop_invariant_p(pc, end, i)) {
+	gen_class_guard(mrb, i, status, pc, coi);
+      }
+    }
+
+    if (getCurr() == head) {
+      return NULL;
+    }
+    /* Jump to loop_entry doesn't reload the cache */
+    regcache_clear();
+    coi->loop_entry = (void *(*)())getCurr();
+    return head;
+  }
+
+  /* Entry of ci at pc for the jump from the code of coi. The loop
+     pre-header of ci is skipped if coi already knows the types
+     it guards */
+  void *
+    jump_entry(mrb_irep *irep, mrb_code *pc, mrbjit_code_info *ci, mrbjit_code_info *coi)
+  {
+    mrb_code *end;
+    int i;
+
+    if (ci->loop_entry == NULL || coi == NULL || coi->reginfo == NULL) {
+      return (void *)ci->entry;
+    }
+
+    end = loop_end(irep, pc);
+    for (i = 0; i < irep->nregs; i++) {
+      mrbjit_reginfo *hinfo = &ci->reginfo[i];
+      mrbjit_reginfo *rinfo = &coi->reginfo[i];
+
+      if (!loop_invariant_p(pc, end, i) || hinfo->type == MRB_TT_FREE) {
+	continue;
+      }
+      if (rinfo->type != hinfo->type ||
+	  (hinfo->type >= MRB_TT_HAS_BASIC && rinfo->klass != hinfo->klass)) {
+	return (void *)ci->entry;
+      }
+    }
+
+    return (void *)ci->loop_entry;
   }
 
   const void
@@ -72,12 +890,35 @@ class MRBJitCode: public Xbyak::CodeGenerator {
   }
 
   void 
-    gen_exit(mrb_code *pc, int is_clr_rc, int is_clr_exitpos, mrbjit_vmstatus *status)
+    gen_exit(mrb_code *pc, int is_clr_rc, int is_clr_exitpos, mrbjit_vmstatus *status,
+	     enum mrbjit_exit_kind kind = MRBJIT_EXIT_OTHER)
   {
+    if (inline_pc && pc) {
+      /* Before exitlab, so it is done for patched exit too */
+      gen_inline_frame(status);
+    }
     inLocalLabel();
     L(".exitlab");
+    if (!is_clr_exitpos) {
+      /* Guard of the exit for mrbjit_dispatch */
+      mov(dword [reg_mrb + OffsetOf(mrb_state, compile_info.exit_kind)], kind);
+      if (kind == MRBJIT_EXIT_CLASS) {
+	mov(dword [reg_mrb + OffsetOf(mrb_state, compile_info.exit_pic_num)], pic_num);
+      }
+    }
+#ifdef MRBJIT_DUMP_TRACE
+    if (pc && status && pc >= (*status->irep)->iseq &&
+	pc < (*status->irep)->iseq + (*status->irep)->ilen) {
+      printf("      exit %-5s %p -> %x\n", mrbjit_exit_kind_name[kind],
+	     getCurr(), (int)(pc - (*status->irep)->iseq));
+    }
+    else {
+      printf("      exit %-5s %p -> %p\n", mrbjit_exit_kind_name[kind],
+	     getCurr(), pc);
+    }
+#endif
     if (pc) {
-      mov(dword [ebx + VMSOffsetOf(pc)], (Xbyak::uint32)pc);
+      gen_mov_ptr_imm(pword [reg_vms + VMSOffsetOf(pc)], pc);
     }
     if (is_clr_rc) {
       xor(eax, eax);
@@ -87,12 +928,18 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     }
     else {
       //mov(edx, (Xbyak::uint32)exit_ptr);
-      mov(edx, ".exitlab");
+      mov(reg_tmp1, ".exitlab");
     }
     ret();
     outLocalLabel();
   }
   
+  void
+    set_pic_num(mrbjit_code_info *coi)
+  {
+    pic_num = coi->pic_num + 1;
+  }
+
   void 
     gen_jump_block(void *entry) 
   {
@@ -111,18 +958,6 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     setSize(cursize);
   }
 
-  void 
-    gen_exit_patch(void *dst, mrb_code *pc, mrbjit_vmstatus *status)
-  {
-    size_t cursize = getSize();
-    const unsigned char *code = getCode();
-    size_t dstsize = (unsigned char *)dst - code;
-
-    setSize(dstsize);
-    gen_exit(pc, 1, 0, status);
-    setSize(cursize);
-  }
-
   void 
     gen_align(unsigned align)
   {
@@ -137,12 +972,16 @@ class MRBJitCode: public Xbyak::CodeGenerator {
   }
 
   void 
-    gen_jmp(mrb_state *mrb, mrbjit_vmstatus *status, mrb_code *curpc, mrb_code *newpc)
+    gen_jmp(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi, mrb_code *curpc, mrb_code *newpc)
   {
     mrbjit_code_info *newci;
     mrb_irep *irep = *status->irep;
     int n = ISEQ_OFFSET_OF(newpc);
-    if (irep->ilen < NO_INLINE_METHOD_LEN || irep->jit_inlinep) {
+    if (inline_pc) {
+      newci = mrbjit_search_codeinfo_prev(irep->jit_entry_tab + n, 
+					  curpc, MRBJIT_INLINE_CALLER(inline_pc));
+    }
+    else if (irep->ilen < NO_INLINE_METHOD_LEN || irep->jit_inlinep) {
       newci = mrbjit_search_codeinfo_prev(irep->jit_entry_tab + n, 
 					  curpc, mrb->c->ci->pc);
     }
@@ -152,7 +991,7 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     }
     if (newci) {
       if (newci->used > 0) {
-	jmp((void *)newci->entry);
+	jmp(jump_entry(irep, newpc, newci, coi));
       }
       else {
 	newci->entry = (void *(*)())getCurr();
@@ -162,6 +1001,26 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     }
   }
 
+  /* Compare type tag in eax with tt. jump to "@f" if type is tt
+     On x86-64, tag of object includes upper bits of pointer */
+  void
+    gen_type_tag_check(enum mrb_vtype tt)
+  {
+    if (tt == MRB_TT_FLOAT) {
+      cmp(eax, 0xfff00000);
+      jb("@f");
+    } 
+    else {
+#ifdef XBYAK64
+      if (tt >= MRB_TT_CPTR) {
+	and(eax, 0xffffc000);
+      }
+#endif
+      cmp(eax, mrb_mktt(tt));
+      jz("@f");
+    }
+  }
+
   void 
     gen_type_guard(mrb_state *mrb, int regpos, mrbjit_vmstatus *status, mrb_code *pc, mrbjit_code_info *coi)
   {
@@ -172,21 +1031,14 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       return;
     }
 
-    mov(eax, dword [ecx + regpos * sizeof(mrb_value) + 4]); /* Get type tag */
+    mov(eax, dword [reg_regs + regpos * sizeof(mrb_value) + 4]); /* Get type tag */
     rinfo->type = tt;
     rinfo->klass = mrb_class(mrb, (*status->regs)[regpos]);
     /* Input eax for type tag */
-    if (tt == MRB_TT_FLOAT) {
-      cmp(eax, 0xfff00000);
-      jb("@f");
-    } 
-    else {
-      cmp(eax, 0xfff00000 | tt);
-      jz("@f");
-    }
+    gen_type_tag_check(tt);
 
     /* Guard fail exit code */
-    gen_exit(pc, 1, 0, status);
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_TYPE);
 
     L("@@");
   }
@@ -197,7 +1049,7 @@ class MRBJitCode: public Xbyak::CodeGenerator {
   void
     gen_bool_guard(mrb_state *mrb, int b, mrb_code *pc, mrbjit_vmstatus *status)
   {
-    cmp(eax, 0xfff00001);
+    cmp(eax, mrb_mktt(MRB_TT_FALSE));
     if (b) {
       jnz("@f");
     } 
@@ -206,7 +1058,64 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     }
 
     /* Guard fail exit code */
-    gen_exit(pc, 1, 0, status);
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_BOOL);
+
+    L("@@");
+  }
+
+  /* Code below assumes sym of kind is not changed. It is near jmp over
+     the exit. mrbjit_invalidate rewrites the offset to 0 to take the
+     exit, so no check runs while the assumption holds */
+  void
+    gen_dependency(mrb_state *mrb, enum mrbjit_dep_kind kind, mrb_sym sym,
+		   mrb_code *pc, mrbjit_vmstatus *status)
+  {
+    void *site = (void *)getCurr();
+
+    jmp("@f", T_NEAR);
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_INVALID);
+    L("@@");
+    mrbjit_add_dependency(mrb, kind, sym, site);
+  }
+
+  /* Class or module with constp reginfo is a folded constant, so its
+     value is fixed in the trace */
+  int
+    const_value_p(mrb_value v)
+  {
+    switch (mrb_type(v)) {
+    case MRB_TT_CLASS:
+    case MRB_TT_MODULE:
+    case MRB_TT_SCLASS:
+      return 1;
+
+    default:
+      return 0;
+    }
+  }
+
+  /* Check the register is the same object as compile time. Class
+     guard is not enough for receivers like Foo of Foo.new, because
+     many classes share Class */
+  void
+    gen_value_guard(mrb_state *mrb, int regpos, mrbjit_vmstatus *status, mrb_code *pc, mrbjit_code_info *coi)
+  {
+    mrb_value v = (*status->regs)[regpos];
+
+    if (coi->reginfo[regpos].constp && const_value_p(v)) {
+      return;
+    }
+
+    gen_load_ptr(reg_tmp0, ptr [reg_regs + regpos * sizeof(mrb_value)]);
+#ifdef XBYAK64
+    mov(r11, (size_t)mrb_ptr(v));
+    cmp(rax, r11);
+#else
+    cmp(eax, (Xbyak::uint32)mrb_ptr(v));
+#endif
+    jz("@f");
+    /* Guard fail exit code */
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_CLASS);
 
     L("@@");
   }
@@ -227,20 +1136,13 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     if (rinfo->type != tt) {
 
       rinfo->type = tt;
+      rinfo->klass = NULL;	/* Class is not checked yet */
 
-      mov(eax, ptr [ecx + regpos * sizeof(mrb_value) + 4]);
-
-      if (tt == MRB_TT_FLOAT) {
-	cmp(eax, 0xfff00000);
-	jb("@f");
-      }
-      else {
-	cmp(eax, 0xfff00000 | tt);
-	jz("@f");
-      }
+      mov(eax, ptr [reg_regs + regpos * sizeof(mrb_value) + 4]);
+      gen_type_tag_check(tt);
 
       /* Guard fail exit code */
-      gen_exit(pc, 1, 0, status);
+      gen_exit(pc, 1, 0, status, MRBJIT_EXIT_TYPE);
 
       L("@@");
     }
@@ -262,12 +1164,17 @@ class MRBJitCode: public Xbyak::CodeGenerator {
 	  return;
 	}
 	rinfo->klass = c;
-	mov(eax, dword [ecx + regpos * sizeof(mrb_value)]);
-	mov(eax, dword [eax + OffsetOf(struct RBasic, c)]);
-	cmp(eax, (int)c);
+	gen_load_ptr(reg_tmp0, ptr [reg_regs + regpos * sizeof(mrb_value)]);
+	mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RBasic, c)]);
+#ifdef XBYAK64
+	mov(r11, (size_t)c);
+	cmp(rax, r11);
+#else
+	cmp(eax, (Xbyak::uint32)c);
+#endif
 	jz("@f");
 	/* Guard fail exit code */
-	gen_exit(pc, 1, 0, status);
+	gen_exit(pc, 1, 0, status, MRBJIT_EXIT_CLASS);
 
 	L("@@");
       }
@@ -275,6 +1182,75 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     }
   }
   
+  /* Check slot ivoff of the first segment of regs[regpos] is instance
+     variable id. Objects of a class can have different layouts,
+     because slots are given in the order of assignment. Slots from
+     last_len of the last segment are not used.
+     Segment is in EAX (RAX) on success. destroy EDX
+  */
+  void
+    gen_iv_guard(mrb_state *mrb, int regpos, int ivoff, mrb_sym id,
+		 mrbjit_vmstatus *status, mrb_code *pc)
+  {
+    inLocalLabel();
+    gen_load_ptr(reg_tmp0, ptr [reg_regs + regpos * sizeof(mrb_value)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RObject, iv)]);
+    test(reg_tmp0, reg_tmp0);
+    jz(".fail");
+    mov(reg_tmp1, ptr [reg_tmp0 + OffsetOf(iv_tbl, last_len)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(iv_tbl, rootseg)]);
+    test(reg_tmp0, reg_tmp0);
+    jz(".fail");
+    cmp(reg_tmp1, ivoff);
+    ja(".used");
+    mov(reg_tmp1, ptr [reg_tmp0 + OffsetOf(segment, next)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".fail");
+    L(".used");
+    cmp(word [reg_tmp0 + OffsetOf(segment, key) + ivoff * sizeof(mrb_sym)], id);
+    jz(".ok");
+    L(".fail");
+    /* Guard fail exit code */
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_CLASS);
+    L(".ok");
+    outLocalLabel();
+  }
+
+  /* Check instance variable id of regs[regpos] is added to slot len
+     of the first segment, that is the first segment is the last one,
+     its last_len is len and id is not in slots before len.
+     Table is in EAX (RAX) on success. destroy EDX
+  */
+  void
+    gen_iv_append_guard(mrb_state *mrb, int regpos, int len, mrb_sym id,
+			mrbjit_vmstatus *status, mrb_code *pc)
+  {
+    int i;
+
+    inLocalLabel();
+    gen_load_ptr(reg_tmp0, ptr [reg_regs + regpos * sizeof(mrb_value)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RObject, iv)]);
+    test(reg_tmp0, reg_tmp0);
+    jz(".fail");
+    cmp(dword [reg_tmp0 + OffsetOf(iv_tbl, last_len)], len);
+    jnz(".fail");
+    mov(reg_tmp1, ptr [reg_tmp0 + OffsetOf(iv_tbl, rootseg)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".fail");
+    for (i = 0; i < len; i++) {
+      cmp(word [reg_tmp1 + OffsetOf(segment, key) + i * sizeof(mrb_sym)], id);
+      jz(".fail");
+    }
+    mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(segment, next)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".ok");
+    L(".fail");
+    /* Guard fail exit code */
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_CLASS);
+    L(".ok");
+    outLocalLabel();
+  }
+
   void
     gen_lvar_get(const Xbyak::Mmx& dst, int no, mrbjit_code_info *coi)
   {
@@ -284,60 +1260,49 @@ class MRBJitCode: public Xbyak::CodeGenerator {
   void 
     gen_set_jit_entry(mrb_state *mrb, mrb_code *pc, mrbjit_code_info *coi, mrb_irep *irep)
   {
-    int ioff;
-    int toff;
-    mrbjit_codetab *ctab;
-
-    ioff = ISEQ_OFFSET_OF(pc);
-    toff = coi - (irep->jit_entry_tab + ioff)->body;
-
-    /* Check and grow code table */
-    ctab = (irep->jit_entry_tab + ioff + 1);
-    if (ctab->size <= toff) {
-      int oldsize;
-      int j;
-
-      oldsize = ctab->size;
-      ctab->size = oldsize + (oldsize >> 1) + 2;
-      ctab->body = (mrbjit_code_info *)mrb_realloc(mrb, ctab->body, 
-						   sizeof(mrbjit_code_info) * ctab->size);
-      for (j = oldsize; j < ctab->size; j++) {
-	ctab->body[j].used = 0;
-      }
+    /* Code info of pc + 1 is keyed by prev_pc in the callee, so the
+       continuation is the generic trace whose address is kept in
+       ret_entry of the code table (it is not moved by rehash). It is
+       read at run time because it may be compiled later */
+    mrbjit_codetab *ctab = irep->jit_entry_tab + ISEQ_OFFSET_OF(pc) + 1;
+
+    /* reg_context must point current context  */
+    mov(reg_tmp0, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    if (coi->caller_pc) {
+      /* The generic trace is for NULL caller_pc. Return through VM */
+      xor(reg_tmp1, reg_tmp1);
     }
-
-    /* This is unused entry, but right.Because no other pathes */
-    mov(edx, (Xbyak::uint32)ctab);
-    mov(edx, dword [edx + OffsetOf(mrbjit_codetab, body)]);
-
-    //ci->jit_entry = (irep->jit_entry_tab + ioff)->body[0].entry;
-    /* edi must point current context  */
-    mov(eax, dword [edi + OffsetOf(mrb_context, ci)]);
-
-    mov(edx, dword [edx 
-		    + toff * sizeof(mrbjit_code_info)
-		    + OffsetOf(mrbjit_code_info, entry)]);
-
-    //printf("%d ", toff);
-    mov(dword [eax + OffsetOf(mrb_callinfo, jit_entry)], edx);
+    else {
+      mov(reg_tmp1, (size_t)&ctab->ret_entry);
+      mov(reg_tmp1, ptr [reg_tmp1]);
+    }
+    mov(ptr [reg_tmp0 + OffsetOf(mrb_callinfo, jit_entry)], reg_tmp1);
   }
 
   void
     gen_call_fetch_hook(mrb_state *mrb, mrbjit_vmstatus *status)
   {
-    push(ecx);
-    push(ebx);
-    push(ecx);
-    //    mov(eax, dword [ebx + VMSOffsetOf(pc)]);
+#ifdef XBYAK64
+    mov(rdi, reg_mrb);
+    mov(rsi, (size_t)(*(status->irep)));
+    mov(rdx, (size_t)(*(status->pc)));
+    mov(rcx, reg_regs);
+    gen_call((void *)mrb->code_fetch_hook);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push(reg_regs);
+    //    mov(eax, dword [reg_vms + VMSOffsetOf(pc)]);
     mov(eax, (Xbyak::uint32)(*(status->pc)));
     push(eax);
     mov(eax, (Xbyak::uint32)(*(status->irep)));
     push(eax);
-    push(esi);
+    push(reg_mrb);
     call((void *)mrb->code_fetch_hook);
-    add(esp, sizeof(void *) * 4);
-    pop(ebx);
-    pop(ecx);
+    add(reg_sp, sizeof(void *) * 4);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
   }
 
   const void *
@@ -358,8 +1323,14 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
     *dinfo = *sinfo;
 
-    movsd(xmm0, ptr [ecx + srcoff]);
-    movsd(ptr [ecx + dstoff], xmm0);
+    gen_regcache_load(xmm0, GETARG_B(**ppc));
+    if (dinfo->type == MRB_TT_FLOAT) {
+      gen_regcache_store(GETARG_A(**ppc), xmm0);
+    }
+    else {
+      movsd(ptr [reg_regs + dstoff], xmm0);
+      regcache_invalidate(GETARG_A(**ppc));
+    }
     return code;
   }
 
@@ -377,9 +1348,15 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = mrb_class(mrb, val);
     dinfo->constp = 1;
 
-    mov(eax, (Xbyak::uint32)irep->pool + srcoff);
-    movsd(xmm0, ptr [eax]);
-    movsd(ptr [ecx + dstoff], xmm0);
+    mov(reg_tmp0, (size_t)irep->pool + srcoff);
+    movsd(xmm0, ptr [reg_tmp0]);
+    if (dinfo->type == MRB_TT_FLOAT) {
+      gen_regcache_store(GETARG_A(**ppc), xmm0);
+    }
+    else {
+      movsd(ptr [reg_regs + dstoff], xmm0);
+      regcache_invalidate(GETARG_A(**ppc));
+    }
 
     return code;
   }
@@ -393,24 +1370,25 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     const Xbyak::uint32 src = GETARG_sBx(**ppc);
     mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
 
+    regcache_invalidate(GETARG_A(**ppc));
     switch(src) {
     case 0:
       xor(eax, eax);
-      mov(dword [ecx + dstoff], eax);
+      mov(dword [reg_regs + dstoff], eax);
       break;
 
     case 1:
       xor(eax, eax);
       inc(eax);
-      mov(dword [ecx + dstoff], eax);
+      mov(dword [reg_regs + dstoff], eax);
       break;
 
     default:
-      mov(dword [ecx + dstoff], src);
+      mov(dword [reg_regs + dstoff], src);
       break;
     }
     if (dinfo->type != MRB_TT_FIXNUM) {
-      mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_FIXNUM);
+      mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_FIXNUM));
       dinfo->type = MRB_TT_FIXNUM;
       dinfo->klass = mrb->fixnum_class;
     }
@@ -433,8 +1411,8 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = mrb->symbol_class;
     dinfo->constp = 1;
 
-    mov(dword [ecx + dstoff], src);
-    mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_SYMBOL);
+    mov(dword [reg_regs + dstoff], src);
+    mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_SYMBOL));
 
     return code;
   }
@@ -451,8 +1429,9 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = mrb_class(mrb, self);
     dinfo->constp = 1;
 
-    movsd(xmm0, ptr [ecx]);
-    movsd(ptr [ecx + dstoff], xmm0);
+    regcache_invalidate(GETARG_A(**ppc));
+    movsd(xmm0, ptr [reg_regs]);
+    movsd(ptr [reg_regs + dstoff], xmm0);
     return code;
   }
 
@@ -464,11 +1443,12 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     const Xbyak::uint32 dstoff = GETARG_A(**ppc) * sizeof(mrb_value);
     mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
 
+    regcache_invalidate(GETARG_A(**ppc));
     if (dinfo->type != MRB_TT_TRUE) {
       xor(eax, eax);
       inc(eax);
-      mov(dword [ecx + dstoff], eax);
-      mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_TRUE);
+      mov(dword [reg_regs + dstoff], eax);
+      mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_TRUE));
       dinfo->type = MRB_TT_TRUE;
       dinfo->klass = mrb->true_class;
       dinfo->constp = 1;
@@ -485,11 +1465,12 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     const Xbyak::uint32 dstoff = GETARG_A(**ppc) * sizeof(mrb_value);
     mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
 
+    regcache_invalidate(GETARG_A(**ppc));
     if (dinfo->type != MRB_TT_FALSE) {
       xor(eax, eax);
       inc(eax);
-      mov(dword [ecx + dstoff], eax);
-      mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_FALSE);
+      mov(dword [reg_regs + dstoff], eax);
+      mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_FALSE));
       dinfo->type = MRB_TT_FALSE;
       dinfo->klass = mrb->false_class;
       dinfo->constp = 1;
@@ -517,20 +1498,9 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     if (ivoff < 0) {
       return NULL;
     }
-
-    /* You can not change class of self in Ruby */
-    if (mrb_type(self) == MRB_TT_OBJECT) {
-      mov(eax, dword [ecx]);
-      mov(eax, dword [eax + OffsetOf(struct RObject, segcache)]);
-      movsd(xmm0, ptr [eax + ivoff * sizeof(mrb_value)]);
-    }
-    else {
-      mov(eax, dword [ecx]);
-      mov(eax, dword [eax + OffsetOf(struct RObject, iv)]);
-      mov(eax, dword [eax]);
-      movsd(xmm0, ptr [eax + ivoff * sizeof(mrb_value)]);
-    }
-    movsd(ptr [ecx + dstoff], xmm0);
+    gen_iv_guard(mrb, 0, ivoff, id, status, *ppc);
+    movsd(xmm0, ptr [reg_tmp0 + ivoff * sizeof(mrb_value)]);
+    movsd(ptr [reg_regs + dstoff], xmm0);
 
     return code;
   }
@@ -549,58 +1519,51 @@ class MRBJitCode: public Xbyak::CodeGenerator {
 
     if (ivoff == -1) {
       /* Normal instance variable set (not defined yet) */
-      push(ecx);
-      push(ebx);
-      mov(eax, ptr [ecx + srcoff + 4]);
+#ifdef XBYAK64
+      mov(rdi, reg_mrb);
+      mov(esi, (Xbyak::uint32)id);
+      mov(rdx, qword [reg_regs + srcoff]);
+      gen_call((void *)mrb_vm_iv_set);
+#else
+      push(reg_regs);
+      push(reg_vms);
+      mov(eax, ptr [reg_regs + srcoff + 4]);
       push(eax);
-      mov(eax, ptr [ecx + srcoff]);
+      mov(eax, ptr [reg_regs + srcoff]);
       push(eax);
       push((Xbyak::uint32)id);
-      push(esi);
+      push(reg_mrb);
       call((void *)mrb_vm_iv_set);
-      add(esp, sizeof(mrb_state *) + sizeof(Xbyak::uint32) + sizeof(mrb_value));
-      pop(ebx);
-      pop(ecx);
+      add(reg_sp, sizeof(mrb_state *) + sizeof(Xbyak::uint32) + sizeof(mrb_value));
+      pop(reg_vms);
+      pop(reg_regs);
+#endif
 
       return code;
     }
 
-    movsd(xmm0, ptr [ecx + srcoff]);
-    mov(eax, dword [ecx]);
-    push(ecx);
-    push(ebx);
-    push(eax);
-    push(esi);
-    call((void *)mrb_write_barrier);
-    add(esp, 4);
-    pop(eax);
-    pop(ebx);
-    pop(ecx);
+    gen_write_barrier(0, &coi->reginfo[GETARG_A(**ppc)]);
     if (ivoff == -2) {
+      ivoff =  mrb_obj_ptr(self)->iv->last_len;
+      gen_iv_append_guard(mrb, 0, ivoff, id, status, *ppc);
+      /* Load after call because xmm0 is not preserved by C function */
+      movsd(xmm0, ptr [reg_regs + srcoff]);
       if (mrb_type(self) == MRB_TT_OBJECT) {
-	mov(edx, eax);
+	gen_load_ptr(reg_tmp1, ptr [reg_regs]);
       }
-      mov(eax, dword [eax + OffsetOf(struct RObject, iv)]);
-      ivoff =  mrb_obj_ptr(self)->iv->last_len;
-      inc(dword [eax + OffsetOf(iv_tbl, last_len)]);
-      inc(dword [eax + OffsetOf(iv_tbl, size)]);
-      mov(eax, dword [eax]);
-      movsd(ptr [eax + ivoff * sizeof(mrb_value)], xmm0);
+      inc(dword [reg_tmp0 + OffsetOf(iv_tbl, last_len)]);
+      inc(dword [reg_tmp0 + OffsetOf(iv_tbl, size)]);
+      mov(reg_tmp0, ptr [reg_tmp0]);
+      movsd(ptr [reg_tmp0 + ivoff * sizeof(mrb_value)], xmm0);
       if (mrb_type(self) == MRB_TT_OBJECT) {
-	mov(dword [edx + OffsetOf(struct RObject, segcache)], eax);
+	mov(ptr [reg_tmp1 + OffsetOf(struct RObject, segcache)], reg_tmp0);
       }
-      mov(dword [eax + MRB_SEGMENT_SIZE * sizeof(mrb_value) + ivoff * sizeof(mrb_sym)], (Xbyak::uint32)id);
+      mov(word [reg_tmp0 + MRB_SEGMENT_SIZE * sizeof(mrb_value) + ivoff * sizeof(mrb_sym)], id);
     }
     else {
-      if (mrb_type(self) == MRB_TT_OBJECT) {
-	mov(eax, dword [eax + OffsetOf(struct RObject, segcache)]);
-	movsd(ptr [eax + ivoff * sizeof(mrb_value)], xmm0);
-      }
-      else {
-	mov(eax, dword [eax + OffsetOf(struct RObject, iv)]);
-	mov(eax, dword [eax]);
-	movsd(ptr [eax + ivoff * sizeof(mrb_value)], xmm0);
-      }
+      gen_iv_guard(mrb, 0, ivoff, id, status, *ppc);
+      movsd(xmm0, ptr [reg_regs + srcoff]);
+      movsd(ptr [reg_tmp0 + ivoff * sizeof(mrb_value)], xmm0);
     }
 
     return code;
@@ -620,16 +1583,21 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = NULL;
     dinfo->constp = 0;
 
-    push(ecx);
-    push(ebx);
+#ifdef XBYAK64
+    mov(rdi, reg_mrb);
+    mov(esi, (Xbyak::uint32)irep->syms[idpos]);
+    gen_call((void *)mrb_vm_cv_get);
+#else
+    push(reg_regs);
+    push(reg_vms);
     push((Xbyak::uint32)irep->syms[idpos]);
-    push(esi);
+    push(reg_mrb);
     call((void *)mrb_vm_cv_get);
-    add(esp, argsize);
-    pop(ebx);
-    pop(ecx);
-    mov(dword [ecx + dstoff], eax);
-    mov(dword [ecx + dstoff + 4], edx);
+    add(reg_sp, argsize);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+    gen_store_cret(dstoff);
 
     return code;
   }
@@ -644,18 +1612,25 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     const int argsize = 4 * sizeof(void *);
     mrb_irep *irep = *status->irep;
 
-    push(ecx);
-    push(ebx);
-    mov(eax, dword [ecx + srcoff + 4]);
+#ifdef XBYAK64
+    mov(rdi, reg_mrb);
+    mov(esi, (Xbyak::uint32)irep->syms[idpos]);
+    mov(rdx, qword [reg_regs + srcoff]);
+    gen_call((void *)mrb_vm_cv_set);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    mov(eax, dword [reg_regs + srcoff + 4]);
     push(eax);
-    mov(eax, dword [ecx + srcoff]);
+    mov(eax, dword [reg_regs + srcoff]);
     push(eax);
     push((Xbyak::uint32)irep->syms[idpos]);
-    push(esi);
+    push(reg_mrb);
     call((void *)mrb_vm_cv_set);
-    add(esp, argsize);
-    pop(ebx);
-    pop(ecx);
+    add(reg_sp, argsize);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
 
     return code;
   }
@@ -674,12 +1649,163 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = mrb_class(mrb, v);
     dinfo->constp = 1;
 
-    mov(dword [ecx + dstoff], v.value.i);
-    mov(dword [ecx + dstoff + 4], v.value.ttt);
+    regcache_invalidate(GETARG_A(**ppc));
+    gen_dependency(mrb, MRBJIT_DEP_CONST, irep->syms[sympos], *ppc, status);
+    mov(dword [reg_regs + dstoff], v.value.i);
+    mov(dword [reg_regs + dstoff + 4], v.value.ttt);
     
     return code;
   }
 
+  /* Exception handling
+     Rescue stack is pushed and popped natively. It is grown by the
+     interpreter at side exit. Raise always exits, so exceptions are
+     handled by the interpreter */
+  const void *
+    emit_onerr(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    mov(eax, dword [reg_tmp1 + OffsetOf(mrb_callinfo, ridx)]);
+    cmp(eax, dword [reg_context + OffsetOf(mrb_context, rsize)]);
+    jl("@f");
+    gen_exit(pc, 1, 0, status);
+    L("@@");
+    inc(dword [reg_tmp1 + OffsetOf(mrb_callinfo, ridx)]);
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, rescue)]);
+    gen_mov_ptr_imm(pword [reg_tmp1 + reg_tmp0 * sizeof(mrb_code *)],
+		    pc + GETARG_sBx(*pc));
+
+    return code;
+  }
+
+  const void *
+    emit_poperr(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    sub(dword [reg_tmp1 + OffsetOf(mrb_callinfo, ridx)], GETARG_A(*pc));
+
+    return code;
+  }
+
+  const void *
+    emit_raise(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+
+    gen_exit(*status->pc, 1, 0, status);
+
+    return code;
+  }
+
+  const void *
+    emit_rescue(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+    const Xbyak::uint32 dstoff = GETARG_A(*pc) * sizeof(mrb_value);
+    mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(*pc)];
+    dinfo->type = MRB_TT_FREE;
+    dinfo->klass = NULL;
+    dinfo->constp = 0;
+
+    if (mrb->exc == NULL) {
+      return NULL;
+    }
+
+    mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, exc)]);
+    gen_store_ptr_value(dstoff, reg_tmp0, (enum mrb_vtype)mrb->exc->tt);
+    xor(reg_tmp0, reg_tmp0);
+    mov(ptr [reg_mrb + OffsetOf(mrb_state, exc)], reg_tmp0);
+
+    return code;
+  }
+
+  const void *
+    emit_epush(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+    mrb_irep *irep = (*status->irep)->reps[GETARG_Bx(*pc)];
+
+#ifdef XBYAK64
+    mov(rdi, reg_mrb);
+    mov(rsi, (size_t)irep);
+    gen_call((void *)mrbjit_exec_epush);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push((Xbyak::uint32)irep);
+    push(reg_mrb);
+    call((void *)mrbjit_exec_epush);
+    add(reg_sp, 2 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    return code;
+  }
+
+  const void *
+    emit_epop(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+
+#ifdef XBYAK64
+    mov(rdi, reg_mrb);
+    mov(esi, (Xbyak::uint32)GETARG_A(*pc));
+    gen_call((void *)mrbjit_exec_epop);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push((Xbyak::uint32)GETARG_A(*pc));
+    push(reg_mrb);
+    call((void *)mrbjit_exec_epop);
+    add(reg_sp, 2 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    return code;
+  }
+
+  /* Scoped constant (e.g. Math::PI). Folded only when the scope is a
+     folded constant too, so the value is known at compile time */
+  const void *
+    emit_getmcnst(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code **ppc = status->pc;
+    const int a = GETARG_A(**ppc);
+    const Xbyak::uint32 dstoff = a * sizeof(mrb_value);
+    mrb_sym sym = (*status->irep)->syms[GETARG_Bx(**ppc)];
+    mrb_value mod = (*status->regs)[a];
+    mrbjit_reginfo *dinfo = &coi->reginfo[a];
+    mrb_value v;
+
+    if (!dinfo->constp || !const_value_p(mod) ||
+	!mrb_const_defined(mrb, mod, sym)) {
+      return NULL;
+    }
+    v = mrb_const_get(mrb, mod, sym);
+    dinfo->type = (mrb_vtype)mrb_type(v);
+    dinfo->klass = mrb_class(mrb, v);
+    dinfo->constp = 1;
+
+    regcache_invalidate(a);
+    gen_dependency(mrb, MRBJIT_DEP_CONST, sym, *ppc, status);
+    mov(dword [reg_regs + dstoff], v.value.i);
+    mov(dword [reg_regs + dstoff + 4], v.value.ttt);
+
+    return code;
+  }
+
   const void *
     emit_loadnil(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi) 
   {
@@ -691,38 +1817,80 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     dinfo->klass = mrb->nil_class;
     dinfo->constp = 1;
 
+    regcache_invalidate(GETARG_A(**ppc));
     xor(eax, eax);
-    mov(dword [ecx + dstoff], eax);
-    mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_FALSE);
+    mov(dword [reg_regs + dstoff], eax);
+    mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_FALSE));
 
     return code;
   }
 
+#ifdef XBYAK64
+/* Regs Map registers are callee saved. Arguments are
+   rdi = mrb, rsi = status, (rdx, rcx = auxargs set by caller) */
+#define CALL_CFUNC_BEGIN                                             \
+  do {                                                               \
+  } while (0)
+
+#define CALL_CFUNC_STATUS(func_name, auxargs)			     \
+  do {                                                               \
+    lea(rsi, ptr [reg_vms + VMSOffsetOf(status)]);                   \
+\
+    /* Update pc */                                                  \
+    gen_mov_ptr_imm(qword [reg_vms + VMSOffsetOf(pc)], *status->pc); \
+\
+    mov(rdi, reg_mrb);                                               \
+    gen_call((void *)func_name);                                     \
+\
+    test(rax, rax);					             \
+    jz("@f");                                                        \
+    gen_exit(NULL, 0, 0, status); 		                     \
+    L("@@");                                                         \
+  }while (0)
+#else
 #define CALL_CFUNC_BEGIN                                             \
   do {                                                               \
-    push(ecx);                                                       \
-    push(ebx);                                                       \
+    push(reg_regs);                                                  \
+    push(reg_vms);                                                   \
   } while (0)
 
 #define CALL_CFUNC_STATUS(func_name, auxargs)			     \
   do {                                                               \
-    lea(eax, dword [ebx + VMSOffsetOf(status)]);                     \
+    lea(eax, dword [reg_vms + VMSOffsetOf(status)]);                 \
     push(eax);                                                       \
 \
     /* Update pc */                                                  \
-    mov(dword [ebx + VMSOffsetOf(pc)], (Xbyak::uint32)(*status->pc));\
+    mov(dword [reg_vms + VMSOffsetOf(pc)], (Xbyak::uint32)(*status->pc));\
 \
-    push(esi);                                                       \
+    push(reg_mrb);                                                   \
     call((void *)func_name);                                         \
-    add(esp, (auxargs + 2) * 4);				     \
-    pop(ebx);                                                        \
-    pop(ecx);                                                        \
+    add(reg_sp, (auxargs + 2) * 4);				     \
+    pop(reg_vms);                                                    \
+    pop(reg_regs);                                                   \
 \
     test(eax, eax);					             \
     jz("@f");                                                        \
     gen_exit(NULL, 0, 0, status); 		                     \
     L("@@");                                                         \
   }while (0)
+#endif
+
+/* Set auxargs (m, c) of CALL_CFUNC_STATUS */
+#ifdef XBYAK64
+#define CALL_CFUNC_ARGS_PROC_CLASS(m, c)                             \
+  do {                                                               \
+    mov(rdx, (size_t)(m));                                           \
+    mov(rcx, (size_t)(c));                                           \
+  } while (0)
+#else
+#define CALL_CFUNC_ARGS_PROC_CLASS(m, c)                             \
+  do {                                                               \
+    mov(eax, (Xbyak::uint32)(c));                                    \
+    push(eax);                                                       \
+    mov(eax, (Xbyak::uint32)(m));                                    \
+    push(eax);                                                       \
+  } while (0)
+#endif
 
   mrb_sym
     method_check(mrb_state *mrb, struct RProc *m, int opcode)
@@ -772,6 +1940,237 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     return ivid;
   }
 
+  /* Method inlining
+     Small leaf method is inlined to the trace without callinfo. Regs
+     of the callee is regs of the caller + A of the send, so only
+     reg_regs is moved. Code info of the callee is keyed by
+     MRBJIT_INLINE_CALLER to keep it from normal entry. Callinfo is
+     made on side exit (gen_inline_frame) */
+  int
+    inline_p()
+  {
+    return inline_pc != NULL;
+  }
+
+  void
+    inline_clear(mrb_state *mrb)
+  {
+    inline_pc = NULL;
+    mrb->compile_info.inline_pc = NULL;
+  }
+
+  /* Return false if instruction in inlined method may call a method
+     by the interpreter (operands are not numeric). The trace ends
+     there */
+  int
+    inline_op_p(mrb_code i, mrb_value *regs)
+  {
+    int a = GETARG_A(i);
+
+    if (inline_pc == NULL) {
+      return 1;
+    }
+    switch(GET_OPCODE(i)) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+      if (!mrb_fixnum_p(regs[a + 1]) && !mrb_float_p(regs[a + 1])) {
+	return 0;
+      }
+      /* fall through */
+    case OP_ADDI:
+    case OP_SUBI:
+      return mrb_fixnum_p(regs[a]) || mrb_float_p(regs[a]);
+
+    default:
+      return 1;
+    }
+  }
+
+  /* Method m called with n arguments can be inlined? Only instructions
+     which never use callinfo are allowed */
+  int
+    inline_method_p(mrb_state *mrb, struct RProc *m, int n)
+  {
+    mrb_irep *irep;
+    size_t i;
+
+    if (inline_pc || MRB_PROC_CFUNC_P(m) || m->env) {
+      return 0;
+    }
+    irep = m->body.irep;
+    if (irep->ilen <= 2 || irep->ilen > MRBJIT_INLINE_METHOD_LEN ||
+	irep->method_kind != NORMAL) {
+      return 0;
+    }
+
+    for (i = 0; i < irep->ilen; i++) {
+      mrb_code c = irep->iseq[i];
+
+      switch(GET_OPCODE(c)) {
+      case OP_ENTER:
+	/* Only required arguments */
+	if (GETARG_Ax(c) != (n << 18)) {
+	  return 0;
+	}
+	break;
+
+      case OP_RETURN:
+	if (GETARG_B(c) != OP_R_NORMAL) {
+	  return 0;
+	}
+	break;
+
+      case OP_NOP:
+      case OP_MOVE:
+      case OP_LOADL:
+      case OP_LOADI:
+      case OP_LOADSYM:
+      case OP_LOADNIL:
+      case OP_LOADSELF:
+      case OP_LOADT:
+      case OP_LOADF:
+      case OP_GETIV:
+      case OP_ADD:
+      case OP_ADDI:
+      case OP_SUB:
+      case OP_SUBI:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_EQ:
+      case OP_LT:
+      case OP_LE:
+      case OP_GT:
+      case OP_GE:
+      case OP_JMP:
+      case OP_JMPIF:
+      case OP_JMPNOT:
+	break;
+
+      default:
+	return 0;
+      }
+    }
+
+    return 1;
+  }
+
+  /* Push callinfo of inlined method for the interpreter. Registers
+     of the callee are already in place */
+  void
+    gen_inline_frame(mrbjit_vmstatus *status)
+  {
+    gen_mov_ptr_imm(pword [reg_vms + VMSOffsetOf(pc)], inline_pc);
+#ifdef XBYAK64
+    lea(rsi, ptr [reg_vms + VMSOffsetOf(status)]);
+    mov(rdi, reg_mrb);
+    mov(rdx, (size_t)inline_proc);
+    mov(rcx, (size_t)inline_class);
+    gen_call((void *)mrbjit_exec_send_mruby);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    push((Xbyak::uint32)inline_class);
+    push((Xbyak::uint32)inline_proc);
+    lea(eax, dword [reg_vms + VMSOffsetOf(status)]);
+    push(eax);
+    push(reg_mrb);
+    call((void *)mrbjit_exec_send_mruby);
+    add(reg_sp, 4 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+    /* Stack may be extended */
+    mov(reg_regs, ptr [reg_vms + VMSOffsetOf(regs)]);
+  }
+
+  const void *
+    emit_send_inline(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi,
+		     struct RProc *m, struct RClass *c)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+    const int a = GETARG_A(*pc);
+    const int n = GETARG_C(*pc);
+    const int nregs = m->body.irep->nregs;
+    int i;
+
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, stend)]);
+    sub(reg_tmp1, (Xbyak::uint32)((a + nregs) * sizeof(mrb_value)));
+    cmp(reg_regs, reg_tmp1);
+    jb("@f");
+    gen_exit(pc, 1, 0, status);
+    L("@@");
+
+    add(reg_regs, (Xbyak::uint32)(a * sizeof(mrb_value)));
+
+    /* Registers after the arguments and the block are nil as
+       stack_extend does for a callee with callinfo. The caller's
+       values there must not be seen by the method or GC */
+    if (n + 2 < nregs) {
+      xor(eax, eax);
+    }
+    for (i = n + 2; i < nregs; i++) {
+      mov(dword [reg_regs + i * sizeof(mrb_value)], eax);
+      mov(dword [reg_regs + i * sizeof(mrb_value) + 4], mrb_mktt(MRB_TT_FALSE));
+    }
+
+    inline_pc = pc;
+    inline_proc = m;
+    inline_class = c;
+    mrb->compile_info.inline_pc = pc;
+
+    return code;
+  }
+
+  /* OP_RETURN of inlined method */
+  const void *
+    emit_return_elided(mrb_state *mrb, mrbjit_vmstatus *status)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+    const int a = GETARG_A(*inline_pc);
+
+    movsd(xmm0, ptr [reg_regs + GETARG_A(*pc) * sizeof(mrb_value)]);
+    movsd(ptr [reg_regs], xmm0);
+    sub(reg_regs, (Xbyak::uint32)(a * sizeof(mrb_value)));
+
+    inline_clear(mrb);
+
+    return code;
+  }
+
+  /* Send of megamorphic call site. No class guard, method is
+     searched at run time (see mrbjit_exec_send_mega) */
+  const void *
+    emit_send_mega(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code *pc = *status->pc;
+
+    CALL_CFUNC_BEGIN;
+    CALL_CFUNC_STATUS(mrbjit_exec_send_mega, 0);
+
+    /* Ruby method is executed by the interpreter from its top */
+#ifdef XBYAK64
+    mov(r11, (size_t)pc);
+    cmp(qword [reg_vms + VMSOffsetOf(pc)], r11);
+#else
+    cmp(dword [reg_vms + VMSOffsetOf(pc)], (Xbyak::uint32)pc);
+#endif
+    jz("@f");
+    gen_exit(NULL, 1, 1, status);
+    L("@@");
+
+    return code;
+  }
+
   const void *
     emit_send(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
   {
@@ -789,6 +2188,7 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     mrb_value recv;
     mrb_sym mid = syms[GETARG_B(i)];
     mrb_sym ivid;
+    int ivoff;
     mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(i)];
     int callee_nregs;
 
@@ -802,40 +2202,44 @@ class MRBJitCode: public Xbyak::CodeGenerator {
 
     recv = regs[a];
     c = mrb_class(mrb, recv);
+
+    /* Polymorphic inline cache is made of branch traces from the
+       class guard below. Stop growing it at MRBJIT_PIC_SIZE */
+    if (coi->pic_num >= MRBJIT_PIC_SIZE) {
+      return emit_send_mega(mrb, status, coi);
+    }
+
     m = mrb_method_search_vm(mrb, &c, mid);
     if (!m) {
       return NULL;
     }
     callee_nregs = m->body.irep->nregs;
 
+    gen_dependency(mrb, MRBJIT_DEP_METHOD, mid, pc, status);
     gen_class_guard(mrb, a, status, pc, coi);
 
-    if ((ivid = is_reader(mrb, m))) {
-      const int ivoff = mrbjit_iv_off(mrb, recv, ivid);
-
+    /* Instance variable not in the first segment is not inlined */
+    if ((ivid = is_reader(mrb, m)) &&
+	(ivoff = mrbjit_iv_off(mrb, recv, ivid)) >= 0) {
       /* Inline IV reader */
-      mov(eax, ptr [ecx + a * sizeof(mrb_value)]);
-      mov(eax, dword [eax + OffsetOf(struct RObject, iv)]);
-      mov(eax, dword [eax]);
-      movsd(xmm0, ptr [eax + ivoff * sizeof(mrb_value)]);
+      gen_iv_guard(mrb, a, ivoff, ivid, status, pc);
+      movsd(xmm0, ptr [reg_tmp0 + ivoff * sizeof(mrb_value)]);
 
       // regs[a] = obj;
-      movsd(ptr [ecx + a * sizeof(mrb_value)], xmm0);
+      movsd(ptr [reg_regs + a * sizeof(mrb_value)], xmm0);
 
       return code;
     }
 
-    if ((ivid = is_writer(mrb, m))) {
-      const int ivoff = mrbjit_iv_off(mrb, recv, ivid);
-
+    if ((ivid = is_writer(mrb, m)) &&
+	(ivoff = mrbjit_iv_off(mrb, recv, ivid)) >= 0) {
       /* Inline IV writer */
-      mov(eax, ptr [ecx + a * sizeof(mrb_value)]);
-      mov(eax, dword [eax + OffsetOf(struct RObject, iv)]);
-      mov(eax, dword [eax]);
+      gen_write_barrier(a * sizeof(mrb_value), &coi->reginfo[a + 1]);
+      gen_iv_guard(mrb, a, ivoff, ivid, status, pc);
 
       // @iv = regs[a];
-      movsd(xmm0, ptr [ecx + (a + 1) * sizeof(mrb_value)]);
-      movsd(ptr [eax + ivoff * sizeof(mrb_value)], xmm0);
+      movsd(xmm0, ptr [reg_regs + (a + 1) * sizeof(mrb_value)]);
+      movsd(ptr [reg_tmp0 + ivoff * sizeof(mrb_value)], xmm0);
 
       return code;
     }
@@ -844,8 +2248,8 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       //SET_NIL_VALUE(regs[a+n+1]);
       int dstoff = (a + n + 1) * sizeof(mrb_value);
       xor(eax, eax);
-      mov(dword [ecx + dstoff], eax);
-      mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_FALSE);
+      mov(dword [reg_regs + dstoff], eax);
+      mov(dword [reg_regs + dstoff + 4], mrb_mktt(MRB_TT_FALSE));
     }
 
     prim = mrb_obj_iv_get(mrb, (struct RObject *)c, mid);
@@ -866,43 +2270,56 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       //puts(mrb_sym2name(mrb, mid)); // for tuning
       //printf("%x \n", irep);
       CALL_CFUNC_BEGIN;
-      mov(eax, (Xbyak::uint32)c);
-      push(eax);
-      mov(eax, (Xbyak::uint32)m);
-      push(eax);
+      CALL_CFUNC_ARGS_PROC_CLASS(m, c);
       CALL_CFUNC_STATUS(mrbjit_exec_send_c, 2);
     }
+    else if (GET_OPCODE(i) == OP_SEND && inline_method_p(mrb, m, n)) {
+      return emit_send_inline(mrb, status, coi, m, c);
+    }
     else {
       /* Reg map */
-      /*    old ci  edx */
-      /*    tmp  eax */
-      mov(edx, dword [edi + OffsetOf(mrb_context, ci)]);
+      /*    old ci  tmp1 */
+      /*    tmp  tmp0 */
+      mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ci)]);
 
-      cmp(edx, dword [edi + OffsetOf(mrb_context, ciend)]);
+      cmp(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ciend)]);
       jb("@f");
 
       if (addr_call_extend_callinfo == NULL) {
-	mov(eax, "@f");
-	push(eax);
+	mov(reg_tmp0, "@f");
+	push(reg_tmp0);
 
 	addr_call_extend_callinfo = (void *)getCurr();
 
 	/* extend cfunction */
+#ifdef XBYAK64
+	push(rdx);
+	mov(rax, ptr [reg_context + OffsetOf(mrb_context, cibase)]);
+	sub(rax, rdx);
+	neg(rax);
+	shr(rax, CALLINFO_SIZE_SHIFT);
+	mov(edx, eax);
+	mov(rsi, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
+	mov(rdi, reg_mrb);
+	gen_call((void *) mrbjit_exec_extend_callinfo);
+	pop(rdx);
+#else
 	push(edx);
-	push(ebx);
-	mov(eax, dword [edi + OffsetOf(mrb_context, cibase)]);
+	push(reg_vms);
+	mov(eax, dword [reg_context + OffsetOf(mrb_context, cibase)]);
 	sub(eax, edx);
 	neg(eax);
-	shr(eax, 6);		/* sizeof mrb_callinfo */
+	shr(eax, CALLINFO_SIZE_SHIFT);
 	push(eax);
-	mov(eax, dword [esi + OffsetOf(mrb_state, c)]);
+	mov(eax, dword [reg_mrb + OffsetOf(mrb_state, c)]);
 	push(eax);
-	push(esi);
+	push(reg_mrb);
 	call((void *) mrbjit_exec_extend_callinfo);
-	add(esp, 3 * sizeof(void *));
-	pop(ebx);
+	add(reg_sp, 3 * sizeof(void *));
+	pop(reg_vms);
 	pop(edx);
-	mov(eax, dword [esi + OffsetOf(mrb_state, c)]);
+#endif
+	mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
 	ret();
       }
       else {
@@ -910,59 +2327,59 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       }
 
       L("@@");
-      /*    ci  edi */
-      /*    tmp  edx */
-      /*    tmp  eax */
-      add(dword [edi + OffsetOf(mrb_context, ci)], (Xbyak::uint32)sizeof(mrb_callinfo));
-      mov(edi, dword [edi + OffsetOf(mrb_context, ci)]);
+      /*    ci  context */
+      /*    tmp  tmp1 */
+      /*    tmp  tmp0 */
+      add(pword [reg_context + OffsetOf(mrb_context, ci)], (Xbyak::uint32)sizeof(mrb_callinfo));
+      mov(reg_context, ptr [reg_context + OffsetOf(mrb_context, ci)]);
 
-      mov(eax, dword [edx + OffsetOf(mrb_callinfo, eidx)]);
-      mov(dword [edi + OffsetOf(mrb_callinfo, eidx)], eax);
-      mov(eax, dword [edx + OffsetOf(mrb_callinfo, ridx)]);
-      mov(dword [edi + OffsetOf(mrb_callinfo, ridx)], eax);
+      mov(eax, dword [reg_tmp1 + OffsetOf(mrb_callinfo, eidx)]);
+      mov(dword [reg_context + OffsetOf(mrb_callinfo, eidx)], eax);
+      mov(eax, dword [reg_tmp1 + OffsetOf(mrb_callinfo, ridx)]);
+      mov(dword [reg_context + OffsetOf(mrb_callinfo, ridx)], eax);
 
       xor(eax, eax);
-      mov(dword [edi + OffsetOf(mrb_callinfo, env)], eax);
-      mov(dword [edi + OffsetOf(mrb_callinfo, jit_entry)], eax);
-      mov(dword [edi + OffsetOf(mrb_callinfo, err)], eax);
+      mov(ptr [reg_context + OffsetOf(mrb_callinfo, env)], reg_tmp0);
+      mov(ptr [reg_context + OffsetOf(mrb_callinfo, jit_entry)], reg_tmp0);
+      mov(ptr [reg_context + OffsetOf(mrb_callinfo, err)], reg_tmp0);
 
       switch(n) {
       case 0:
-	mov(dword [edi + OffsetOf(mrb_callinfo, argc)], eax);
+	mov(dword [reg_context + OffsetOf(mrb_callinfo, argc)], eax);
 	break;
 
       case 1:
 	inc(eax);
-	mov(dword [edi + OffsetOf(mrb_callinfo, argc)], eax);
+	mov(dword [reg_context + OffsetOf(mrb_callinfo, argc)], eax);
 	break;
 
       default:
-	mov(dword [edi + OffsetOf(mrb_callinfo, argc)], (Xbyak::uint32)n);
+	mov(dword [reg_context + OffsetOf(mrb_callinfo, argc)], (Xbyak::uint32)n);
 	break;
       }
 
-      mov(edx, dword [esi + OffsetOf(mrb_state, c)]);
-      mov(eax, dword [edx + OffsetOf(mrb_context, stack)]);
-      mov(dword [edi + OffsetOf(mrb_callinfo, stackent)], eax);
+      mov(reg_tmp1, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
+      mov(reg_tmp0, ptr [reg_tmp1 + OffsetOf(mrb_context, stack)]);
+      mov(ptr [reg_context + OffsetOf(mrb_callinfo, stackent)], reg_tmp0);
 
       if (c->tt == MRB_TT_ICLASS) {
-	mov(dword [edi + OffsetOf(mrb_callinfo, target_class)], 
-	    (Xbyak::uint32)c->c);
+	gen_mov_ptr_imm(pword [reg_context + OffsetOf(mrb_callinfo, target_class)], 
+			c->c);
       }
       else {
-	mov(dword [edi + OffsetOf(mrb_callinfo, target_class)], 
-	    (Xbyak::uint32)c);
+	gen_mov_ptr_imm(pword [reg_context + OffsetOf(mrb_callinfo, target_class)], 
+			c);
       }
 
-      mov(dword [edi + OffsetOf(mrb_callinfo, pc)], (Xbyak::uint32)(pc + 1));
+      gen_mov_ptr_imm(pword [reg_context + OffsetOf(mrb_callinfo, pc)], pc + 1);
 
       if (m->body.irep->ilen > 2) {
-	mov(dword [edi + OffsetOf(mrb_callinfo, nregs)], 
+	mov(dword [reg_context + OffsetOf(mrb_callinfo, nregs)], 
 	    (Xbyak::uint32)m->body.irep->nregs);
 
-	mov(dword [edi + OffsetOf(mrb_callinfo, proc)], (Xbyak::uint32)m);
+	gen_mov_ptr_imm(pword [reg_context + OffsetOf(mrb_callinfo, proc)], m);
 
-	mov(dword [ebx + VMSOffsetOf(irep)], (Xbyak::uint32)m->body.irep);
+	gen_mov_ptr_imm(pword [reg_vms + VMSOffsetOf(irep)], m->body.irep);
 
       }
       else {
@@ -971,37 +2388,46 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       }
 
       mov(eax, (Xbyak::uint32)a);
-      mov(dword [edi + OffsetOf(mrb_callinfo, acc)], eax);
+      mov(dword [reg_context + OffsetOf(mrb_callinfo, acc)], eax);
 
-      /*  mrb->c   edi  */
-      mov(edi, dword [esi + OffsetOf(mrb_state, c)]);
+      /*  mrb->c   reg_context  */
+      mov(reg_context, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
       shl(eax, 3);		/* * sizeof(mrb_value) */
-      add(dword [edi + OffsetOf(mrb_context, stack)], eax);
-      mov(ecx, dword [edi + OffsetOf(mrb_context, stack)]);
+      add(ptr [reg_context + OffsetOf(mrb_context, stack)], reg_tmp0);
+      mov(reg_regs, ptr [reg_context + OffsetOf(mrb_context, stack)]);
 
-      mov(edx, dword [edi + OffsetOf(mrb_context, stend)]);
+      mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, stend)]);
       if (m->body.irep->nregs != 0) {
-	sub(edx, (Xbyak::uint32)callee_nregs * sizeof(mrb_value));
+	sub(reg_tmp1, (Xbyak::uint32)callee_nregs * sizeof(mrb_value));
       }
-      cmp(ecx, edx);
+      cmp(reg_regs, reg_tmp1);
       jb("@f");
 
       if (addr_call_stack_extend == NULL) {
-	mov(eax, "@f");
-	push(eax);
+	mov(reg_tmp0, "@f");
+	push(reg_tmp0);
 	mov(edx, (Xbyak::uint32)callee_nregs);
 	mov(eax, (Xbyak::uint32)(mrb->c->ci->argc + 2));
 
 	addr_call_stack_extend = (void *)getCurr();
 
-	push(ebx);
+#ifdef XBYAK64
+	mov(esi, edx);
+	mov(edx, eax);
+	mov(rdi, reg_mrb);
+	sub(rsp, 8);
+	gen_call((void *) mrbjit_stack_extend);
+	add(rsp, 8);
+#else
+	push(reg_vms);
 	push(eax);
 	push(edx);
-	push(esi);
+	push(reg_mrb);
 	call((void *) mrbjit_stack_extend);
-	add(esp, 3 * sizeof(void *));
-	pop(ebx);
-	mov(ecx, dword [edi + OffsetOf(mrb_context, stack)]);
+	add(reg_sp, 3 * sizeof(void *));
+	pop(reg_vms);
+#endif
+	mov(reg_regs, ptr [reg_context + OffsetOf(mrb_context, stack)]);
 	ret();
       }
       else {
@@ -1012,7 +2438,7 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       
       L("@@");
 
-      mov(dword [ebx + VMSOffsetOf(regs)], ecx);
+      mov(ptr [reg_vms + VMSOffsetOf(regs)], reg_regs);
 
       gen_set_jit_entry(mrb, pc, coi, irep);
     }
@@ -1044,30 +2470,120 @@ class MRBJitCode: public Xbyak::CodeGenerator {
       return NULL;
     }
 
-    mov(eax, dword [ecx + OffsetOf(mrb_value, value.p0)]);
-    mov(eax, dword [eax + OffsetOf(struct RProc, body.irep)]);
-    mov(eax, dword [eax + OffsetOf(mrb_irep, jit_top_entry)]);
-    test(eax, eax);
-    push(eax);
+    /* Block of the call site is specialized on its irep (e.g.
+       block.call in Array#each is keyed by the caller of each). Body
+       of the block follows in this trace. Other blocks go to their
+       own entry */
+    inLocalLabel();
+    gen_load_ptr(reg_tmp0, ptr [reg_regs]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RProc, body.irep)]);
+#ifdef XBYAK64
+    mov(r11, (size_t)m->body.irep);
+    cmp(reg_tmp0, r11);
+#else
+    cmp(reg_tmp0, (Xbyak::uint32)m->body.irep);
+#endif
+    jz(".inline", T_NEAR);
+
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(mrb_irep, jit_top_entry)]);
+    test(reg_tmp0, reg_tmp0);
+    push(reg_tmp0);
     jnz("@f");
-    pop(eax);
+    pop(reg_tmp0);
+    gen_exit(*status->pc, 1, 1, status);
+    L("@@");
+    gen_call_exec_call(status, 8);	/* entry is pushed */
+    ret();
+
+    L(".inline");
+    /* mrbjit_exec_call doesn't extend stack */
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, stend)]);
+    sub(reg_tmp1, (Xbyak::uint32)(m->body.irep->nregs * sizeof(mrb_value)));
+    cmp(reg_regs, reg_tmp1);
+    jb("@f");
     gen_exit(*status->pc, 1, 1, status);
     L("@@");
+    gen_enter_block(status, m->body.irep);
+    outLocalLabel();
+
+    return code;
+  }
+
+  /* Inline version of mrbjit_exec_call for the block of irep in
+     regs[0]. Iterator calls its block with environment of the caller
+     alive (env->stack is set), so it is done by a few stores. Others
+     call mrbjit_exec_call */
+  void
+    gen_enter_block(mrbjit_vmstatus *status, mrb_irep *irep)
+  {
+    inLocalLabel();
+    gen_load_ptr(reg_tmp0, ptr [reg_regs]);
+    mov(reg_tmp1, ptr [reg_tmp0 + OffsetOf(struct RProc, env)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".slow");
+    mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct REnv, stack)]);
+    test(reg_tmp1, reg_tmp1);
+    jz(".slow");
+
+    /* regs[0] = env->stack[0] (self of the block) */
+    movsd(xmm0, ptr [reg_tmp1]);
+    movsd(ptr [reg_regs], xmm0);
+
+    /* replace callinfo */
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    mov(ptr [reg_tmp1 + OffsetOf(mrb_callinfo, proc)], reg_tmp0);
+    mov(ptr [reg_vms + VMSOffsetOf(proc)], reg_tmp0);
+    mov(dword [reg_tmp1 + OffsetOf(mrb_callinfo, nregs)], (Xbyak::uint32)irep->nregs);
+#ifdef XBYAK64
+    mov(r11, ptr [reg_tmp0 + OffsetOf(struct RProc, target_class)]);
+    mov(ptr [reg_tmp1 + OffsetOf(mrb_callinfo, target_class)], r11);
+#else
+    push(dword [reg_tmp0 + OffsetOf(struct RProc, target_class)]);
+    pop(dword [reg_tmp1 + OffsetOf(mrb_callinfo, target_class)]);
+#endif
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RProc, env)]);
+    movzx(eax, word [reg_tmp0 + OffsetOf(struct REnv, mid)]);
+    test(eax, eax);
+    jz("@f");
+    mov(word [reg_tmp1 + OffsetOf(mrb_callinfo, mid)], ax);
+    L("@@");
+    gen_mov_ptr_imm(pword [reg_vms + VMSOffsetOf(irep)], irep);
+    jmp(".entered");
+
+    L(".slow");
+    gen_call_exec_call(status, 0);
+    L(".entered");
+    outLocalLabel();
+  }
 
-    push(ecx);
-    push(ebx);
+  /* Replace callinfo by the proc in regs[0] and set status to its
+     top. pad is stack adjustment of x86-64 to keep 16 byte alignment */
+  void
+    gen_call_exec_call(mrbjit_vmstatus *status, int pad)
+  {
+#ifdef XBYAK64
+    lea(rsi, ptr [reg_vms + VMSOffsetOf(status)]);
+    mov(rdi, reg_mrb);
+    if (pad) {
+      sub(rsp, pad);
+    }
+    gen_call((void *)mrbjit_exec_call);
+    if (pad) {
+      add(rsp, pad);
+    }
+#else
+    push(reg_regs);
+    push(reg_vms);
 
-    lea(eax, dword [ebx + VMSOffsetOf(status)]);
+    lea(eax, dword [reg_vms + VMSOffsetOf(status)]);
     push(eax);
-    push(esi);
+    push(reg_mrb);
     call((void *)mrbjit_exec_call);
-    add(esp, 2 * sizeof(void *));
+    add(reg_sp, 2 * sizeof(void *));
 
-    pop(ebx);
-    pop(ecx);
-    ret();
-
-    return code;
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
   }
 
   const void *
@@ -1108,83 +2624,96 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     inLocalLabel();
 
     /* Set return address from callinfo */
-    mov(edx, dword [edi + OffsetOf(mrb_context, ci)]);
-    mov(eax, dword [edx + OffsetOf(mrb_callinfo, jit_entry)]);
-    test(eax, eax);
-    push(eax);
+    mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    mov(reg_tmp0, ptr [reg_tmp1 + OffsetOf(mrb_callinfo, jit_entry)]);
+    test(reg_tmp0, reg_tmp0);
+    push(reg_tmp0);
     jnz("@f");
     L(".ret_vm");
-    pop(eax);
+    pop(reg_tmp0);
     gen_exit(*status->pc, 1, 0, status);
     L("@@");
     
     if (can_inline) {
       /* Check exception happened? */
-      mov(eax, dword [esi + OffsetOf(mrb_state, exc)]);
-      test(eax, eax);
+      mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, exc)]);
+      test(reg_tmp0, reg_tmp0);
       jnz(".ret_vm");
 
       /* Inline else part of mrbjit_exec_return_fast (but not ensure call) */
-      push(edi);
+      push(reg_context);
 
-      mov(edi, edx);
+      mov(reg_context, reg_tmp1);
 
 
       /* Save return value */
-      movsd(xmm0, ptr [ecx + GETARG_A(i) * sizeof(mrb_value)]);
+      movsd(xmm0, ptr [reg_regs + GETARG_A(i) * sizeof(mrb_value)]);
       /* Store return value (bottom of stack always return space) */
-      movsd(ptr [ecx], xmm0);
+      movsd(ptr [reg_regs], xmm0);
 
       /* Restore Regs */
-      mov(ecx, dword [edi + OffsetOf(mrb_callinfo, stackent)]);
-      mov(dword [ebx + VMSOffsetOf(regs)], ecx);
+      mov(reg_regs, ptr [reg_context + OffsetOf(mrb_callinfo, stackent)]);
+      mov(ptr [reg_vms + VMSOffsetOf(regs)], reg_regs);
 
       /* Restore c->stack */
-      mov(eax, dword [esi + OffsetOf(mrb_state, c)]);
-      mov(dword [eax + OffsetOf(mrb_context, stack)], ecx);
+      mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
+      mov(ptr [reg_tmp0 + OffsetOf(mrb_context, stack)], reg_regs);
 
       /* pop ci */
-      mov(eax, dword [esi + OffsetOf(mrb_state, c)]);
-      sub(edi, (Xbyak::uint32)sizeof(mrb_callinfo));
-      mov(dword [eax + OffsetOf(mrb_context, ci)], edi);
+      mov(reg_tmp0, ptr [reg_mrb + OffsetOf(mrb_state, c)]);
+      sub(reg_context, (Xbyak::uint32)sizeof(mrb_callinfo));
+      mov(ptr [reg_tmp0 + OffsetOf(mrb_context, ci)], reg_context);
 
       /* restore proc */
-      mov(edx, dword [edi + OffsetOf(mrb_callinfo, proc)]);
-      mov(dword [ebx + VMSOffsetOf(proc)], edx);
+      mov(reg_tmp1, ptr [reg_context + OffsetOf(mrb_callinfo, proc)]);
+      mov(ptr [reg_vms + VMSOffsetOf(proc)], reg_tmp1);
 
       /* restore irep */
-      mov(edx, dword [edx + OffsetOf(struct RProc, body.irep)]);
-      mov(dword [ebx + VMSOffsetOf(irep)], edx);
+      mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RProc, body.irep)]);
+      mov(ptr [reg_vms + VMSOffsetOf(irep)], reg_tmp1);
 
-      pop(edi);
+      pop(reg_context);
 
       ret();
     }
     else {
       /* Update pc */
-      mov(dword [ebx + VMSOffsetOf(pc)], (Xbyak::uint32)(*status->pc));
+      gen_mov_ptr_imm(pword [reg_vms + VMSOffsetOf(pc)], *status->pc);
 
-      push(ecx);
-      push(ebx);
+#ifdef XBYAK64
+      lea(rsi, ptr [reg_vms + VMSOffsetOf(status)]);
+      mov(rdi, reg_mrb);
+      sub(rsp, 8);
+      if (can_use_fast) {
+	gen_call((void *)mrbjit_exec_return_fast);
+      }
+      else {
+	gen_call((void *)mrbjit_exec_return);
+      }
+      add(rsp, 8);
+#else
+      push(reg_regs);
+      push(reg_vms);
 
-      lea(eax, dword [ebx + VMSOffsetOf(status)]);
+      lea(eax, dword [reg_vms + VMSOffsetOf(status)]);
       push(eax);
-      push(esi);
+      push(reg_mrb);
       if (can_use_fast) {
 	call((void *)mrbjit_exec_return_fast);
       }
       else {
 	call((void *)mrbjit_exec_return);
       }
-      add(esp, 2 * 4);
-      pop(ebx);
-      pop(ecx);
+      add(reg_sp, 2 * 4);
+      pop(reg_vms);
+      pop(reg_regs);
+#endif
 
-      mov(ecx, dword [ebx + VMSOffsetOf(regs)]);
+      mov(reg_regs, ptr [reg_vms + VMSOffsetOf(regs)]);
 
-      test(eax, eax);
+      test(reg_tmp0, reg_tmp0);
       jz("@f");
-      pop(edx);			/* pop return address from callinfo */
+      pop(reg_tmp1);			/* pop return address from callinfo */
       gen_exit(NULL, 0, 0, status);
       L("@@");
 
@@ -1203,17 +2732,17 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     CALL_CFUNC_BEGIN;
     CALL_CFUNC_STATUS(mrbjit_exec_return, 0);
 
-    mov(ecx, dword [ebx + VMSOffsetOf(regs)]);
+    mov(reg_regs, ptr [reg_vms + VMSOffsetOf(regs)]);
 
     return code;
   }
 
 #define OVERFLOW_CHECK_GEN(AINSTF)                                      \
     jno("@f");                                                          \
-    cvtsi2sd(xmm0, dword [ecx + reg0off]);                              \
-    cvtsi2sd(xmm1, dword [ecx + reg1off]);				\
+    cvtsi2sd(xmm0, dword [reg_regs + reg0off]);                              \
+    cvtsi2sd(xmm1, dword [reg_regs + reg1off]);				\
     AINSTF(xmm0, xmm1);                                                 \
-    movsd(ptr [ecx + reg0off], xmm0);                                   \
+    movsd(ptr [reg_regs + reg0off], xmm0);                                   \
     gen_exit(*status->pc + 1, 1, 1, status);				\
     L("@@");                                                            \
 
@@ -1232,31 +2761,32 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     gen_type_guard(mrb, reg1pos, status, *ppc, coi);			\
 \
     if (r0type == MRB_TT_FIXNUM && r1type == MRB_TT_FIXNUM) {           \
-      mov(eax, dword [ecx + reg0off]);                                  \
-      AINSTI(eax, dword [ecx + reg1off]);			        \
+      mov(eax, dword [reg_regs + reg0off]);                                  \
+      AINSTI(eax, dword [reg_regs + reg1off]);			        \
       OVERFLOW_CHECK_GEN(AINSTF);                                       \
-      mov(dword [ecx + reg0off], eax);                                  \
+      mov(dword [reg_regs + reg0off], eax);                                  \
+      regcache_invalidate(reg0pos);                                     \
       dinfo->type = MRB_TT_FIXNUM;  					\
       dinfo->klass = mrb->fixnum_class; 				\
     }                                                                   \
     else if ((r0type == MRB_TT_FLOAT || r0type == MRB_TT_FIXNUM) &&     \
              (r1type == MRB_TT_FLOAT || r1type == MRB_TT_FIXNUM)) {	\
       if (r0type == MRB_TT_FIXNUM) {                                    \
-        cvtsi2sd(xmm0, dword [ecx + reg0off]);                          \
+        cvtsi2sd(xmm0, dword [reg_regs + reg0off]);                          \
       }                                                                 \
       else {                                                            \
-        movsd(xmm0, dword [ecx + reg0off]);                             \
+        gen_regcache_load(xmm0, reg0pos);                               \
       }                                                                 \
 \
       if (r1type == MRB_TT_FIXNUM) {                                    \
-        cvtsi2sd(xmm1, dword [ecx + reg1off]);                          \
+        cvtsi2sd(xmm1, dword [reg_regs + reg1off]);                          \
       }                                                                 \
       else {                                                            \
-        movsd(xmm1, dword [ecx + reg1off]);                             \
+        gen_regcache_load(xmm1, reg1pos);                               \
       }                                                                 \
 \
       AINSTF(xmm0, xmm1);				                \
-      movsd(ptr [ecx + reg0off], xmm0);                                 \
+      gen_regcache_store(reg0pos, xmm0);                                \
       dinfo->type = MRB_TT_FLOAT;                                       \
       dinfo->klass = mrb->float_class;                                  \
     }                                                                   \
@@ -1309,21 +2839,21 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     gen_type_guard(mrb, reg1pos, status, *ppc, coi);
 
     if (r0type == MRB_TT_FIXNUM) {
-      cvtsi2sd(xmm0, dword [ecx + reg0off]);
+      cvtsi2sd(xmm0, dword [reg_regs + reg0off]);
     }
     else {
-      movsd(xmm0, dword [ecx + reg0off]);
+      gen_regcache_load(xmm0, reg0pos);
     }
 
     if (r1type == MRB_TT_FIXNUM) {
-      cvtsi2sd(xmm1, dword [ecx + reg1off]);
+      cvtsi2sd(xmm1, dword [reg_regs + reg1off]);
     }
     else {
-      movsd(xmm1, dword [ecx + reg1off]);
+      gen_regcache_load(xmm1, reg1pos);
     }
 
     divsd(xmm0, xmm1);
-    movsd(ptr [ecx + reg0off], xmm0);
+    gen_regcache_store(reg0pos, xmm0);
 
     /* Div returns Float always */
     /* see http://qiita.com/monamour555/items/bcef9b41a5cc4670675a */
@@ -1335,11 +2865,11 @@ class MRBJitCode: public Xbyak::CodeGenerator {
 
 #define OVERFLOW_CHECK_I_GEN(AINSTF)                                    \
     jno("@f");                                                          \
-    cvtsi2sd(xmm0, dword [ecx + off]);                                  \
+    cvtsi2sd(xmm0, dword [reg_regs + off]);                                  \
     mov(eax, y);                                                        \
     cvtsi2sd(xmm1, eax);                                                \
     AINSTF(xmm0, xmm1);                                                 \
-    movsd(ptr [ecx + off], xmm0);                                       \
+    movsd(ptr [reg_regs + off], xmm0);                                       \
     gen_exit(*status->pc + 1, 1, 1, status);				\
     L("@@");                                                            \
 
@@ -1354,19 +2884,20 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     gen_type_guard(mrb, regno, status, *ppc, coi);			\
 \
     if (atype == MRB_TT_FIXNUM) {                                       \
-      mov(eax, dword [ecx + off]);                                      \
+      mov(eax, dword [reg_regs + off]);                                      \
       AINSTI(eax, y);                                                   \
       OVERFLOW_CHECK_I_GEN(AINSTF);                                     \
-      mov(dword [ecx + off], eax);                                      \
+      mov(dword [reg_regs + off], eax);                                      \
+      regcache_invalidate(regno);                                       \
       dinfo->type = MRB_TT_FIXNUM;       				\
       dinfo->klass = mrb->fixnum_class; 				\
     }                                                                   \
     else if (atype == MRB_TT_FLOAT) {					\
-      movsd(xmm0, ptr [ecx + off]);                                     \
+      gen_regcache_load(xmm0, regno);                                   \
       mov(eax, y);                                                      \
       cvtsi2sd(xmm1, eax);                                              \
       AINSTF(xmm0, xmm1);                                               \
-      movsd(ptr [ecx + off], xmm0);                                     \
+      gen_regcache_store(regno, xmm0);                                  \
       dinfo->type = MRB_TT_FLOAT;					\
       dinfo->klass = mrb->float_class;  				\
     }                                                                   \
@@ -1393,67 +2924,71 @@ class MRBJitCode: public Xbyak::CodeGenerator {
     return code;
   }
 
-#define COMP_GEN_II(CMPINST)                                         \
+#define COMP_GEN_II                                                  \
 do {                                                                 \
-    mov(eax, dword [ecx + off0]);                                    \
-    cmp(eax, dword [ecx + off1]);                                    \
-    CMPINST(al);						     \
-    mov(ah, 0);							     \
+    mov(eax, dword [reg_regs + off0]);                                    \
+    cmp(eax, dword [reg_regs + off1]);                                    \
 } while(0)
 
-#define COMP_GEN_IF(CMPINST)                                         \
+#define COMP_GEN_IF                                                  \
 do {                                                                 \
-    cvtsi2sd(xmm0, ptr [ecx + off0]);                                \
-    xor(eax, eax);					             \
-    comisd(xmm0, ptr [ecx + off1]);				     \
-    CMPINST(al);						     \
+    cvtsi2sd(xmm0, ptr [reg_regs + off0]);                                \
+    gen_regcache_load(xmm1, regno + 1);                              \
+    comisd(xmm0, xmm1);     			                     \
 } while(0)
 
-#define COMP_GEN_FI(CMPINST)                                         \
+#define COMP_GEN_FI                                                  \
 do {                                                                 \
-    movsd(xmm0, ptr [ecx + off0]);				     \
-    cvtsi2sd(xmm1, ptr [ecx + off1]);                                \
-    xor(eax, eax);					             \
+    gen_regcache_load(xmm0, regno);                                  \
+    cvtsi2sd(xmm1, ptr [reg_regs + off1]);                                \
     comisd(xmm0, xmm1);     			                     \
-    CMPINST(al);						     \
 } while(0)
 
-#define COMP_GEN_FF(CMPINST)                                         \
+#define COMP_GEN_FF                                                  \
 do {                                                                 \
-    movsd(xmm0, dword [ecx + off0]);                                 \
-    xor(eax, eax);					             \
-    comisd(xmm0, ptr [ecx + off1]);				     \
-    CMPINST(al);						     \
+    gen_regcache_load(xmm0, regno);                                  \
+    gen_regcache_load(xmm1, regno + 1);                              \
+    comisd(xmm0, xmm1);     			                     \
 } while(0)
     
-#define COMP_GEN(CMPINSTI, CMPINSTF)				     \
+/* Result of comparison is left in flags and boolean is not made when
+   the next instruction is a conditional jump (see emit_jmpif). */
+#define COMP_GEN(CCI, CCF)                                           \
 do {                                                                 \
     int regno = GETARG_A(**ppc);                                     \
     const Xbyak::uint32 off0 = regno * sizeof(mrb_value);            \
     const Xbyak::uint32 off1 = off0 + sizeof(mrb_value);             \
+    enum mrbjit_cc cc;                                               \
     gen_type_guard(mrb, regno, status, *ppc, coi);		     \
     gen_type_guard(mrb, regno + 1, status, *ppc, coi);		     \
                                                                      \
     if (mrb_type(regs[regno]) == MRB_TT_FLOAT &&                     \
              mrb_type(regs[regno + 1]) == MRB_TT_FIXNUM) {           \
-          COMP_GEN_FI(CMPINSTF);                                     \
+          COMP_GEN_FI;                                               \
+          cc = CCF;                                                  \
     }                                                                \
     else if (mrb_type(regs[regno]) == MRB_TT_FIXNUM &&               \
              mrb_type(regs[regno + 1]) == MRB_TT_FLOAT) {            \
-          COMP_GEN_IF(CMPINSTF);                                     \
+          COMP_GEN_IF;                                               \
+          cc = CCF;                                                  \
     }                                                                \
     else if (mrb_type(regs[regno]) == MRB_TT_FLOAT &&                \
              mrb_type(regs[regno + 1]) == MRB_TT_FLOAT) {            \
-          COMP_GEN_FF(CMPINSTF);                                     \
+          COMP_GEN_FF;                                               \
+          cc = CCF;                                                  \
     }                                                                \
     else {                                                           \
-          COMP_GEN_II(CMPINSTI);                                     \
+          COMP_GEN_II;                                               \
+          cc = CCI;                                                  \
     }                                                                \
-    cwde();                                                          \
-    add(eax, eax);                                                   \
-    or(eax, 0xfff00001);                                             \
-    mov(dword [ecx + off0 + 4], eax);                                \
-    mov(dword [ecx + off0], 1);                                      \
+    if (cmp_fusible_p(mrb, *ppc)) {                                  \
+      cmp_pending_regno = regno;                                     \
+      cmp_pending_cc = cc;                                           \
+    }                                                                \
+    else {                                                           \
+      gen_bool_value(cc, regno);                                     \
+    }                                                                \
+    regcache_invalidate(regno);                                      \
  } while(0)
   
   const void *
@@ -1470,7 +3005,7 @@ do {                                                                 \
     case MRB_TT_SYMBOL:
     case MRB_TT_FIXNUM:
     case MRB_TT_FLOAT:
-      COMP_GEN(setz, setz);
+      COMP_GEN(MRBJIT_CC_Z, MRBJIT_CC_Z);
       break;
 
     default:
@@ -1485,7 +3020,7 @@ do {                                                                 \
   {
     const void *code = getCurr();
     mrb_code **ppc = status->pc;
-    COMP_GEN(setl, setb);
+    COMP_GEN(MRBJIT_CC_L, MRBJIT_CC_B);
 
     return code;
   }
@@ -1495,7 +3030,7 @@ do {                                                                 \
   {
     const void *code = getCurr();
     mrb_code **ppc = status->pc;
-    COMP_GEN(setle, setbe);
+    COMP_GEN(MRBJIT_CC_LE, MRBJIT_CC_BE);
 
     return code;
   }
@@ -1505,7 +3040,7 @@ do {                                                                 \
   {
     const void *code = getCurr();
     mrb_code **ppc = status->pc;
-    COMP_GEN(setg, seta);
+    COMP_GEN(MRBJIT_CC_G, MRBJIT_CC_A);
 
     return code;
   }
@@ -1515,7 +3050,7 @@ do {                                                                 \
   {
     const void *code = getCurr();
     mrb_code **ppc = status->pc;
-    COMP_GEN(setge, setae);
+    COMP_GEN(MRBJIT_CC_GE, MRBJIT_CC_AE);
 
     return code;
   }
@@ -1533,22 +3068,135 @@ do {                                                                 \
     dinfo->klass = mrb->array_class;
     dinfo->constp = 0;
 
-    push(ecx);
-    push(ebx);
+#ifdef XBYAK64
+    lea(rdx, ptr [reg_regs + srcoff]);
+    mov(esi, siz);
+    mov(rdi, reg_mrb);
+    gen_call((void *) mrb_ary_new_from_values);
+#else
+    push(reg_regs);
+    push(reg_vms);
 
-    lea(eax, ptr [ecx + srcoff]);
+    lea(eax, ptr [reg_regs + srcoff]);
     push(eax);
     mov(eax, siz);
     push(eax);
-    push(esi);
+    push(reg_mrb);
     call((void *) mrb_ary_new_from_values);
-    add(esp, sizeof(mrb_state *) + sizeof(int) + sizeof(mrb_value *));
+    add(reg_sp, sizeof(mrb_state *) + sizeof(int) + sizeof(mrb_value *));
     
-    pop(ebx);
-    pop(ecx);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    gen_store_cret(dstoff);
+    return code;
+  }
+
+  const void *
+    emit_string(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code **ppc = status->pc;
+    int dstoff = GETARG_A(**ppc) * sizeof(mrb_value);
+    mrb_value *lit = (*status->irep)->pool + GETARG_Bx(**ppc);
+    mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
+    dinfo->type = MRB_TT_STRING;
+    dinfo->klass = mrb->string_class;
+    dinfo->constp = 0;
+
+#ifdef XBYAK64
+    mov(rsi, (size_t)lit);
+    mov(rsi, ptr [rsi]);
+    mov(rdi, reg_mrb);
+    gen_call((void *) mrbjit_exec_string);
+#else
+    push(reg_regs);
+    push(reg_vms);
+
+    mov(eax, (Xbyak::uint32)lit);
+    push(dword [eax + 4]);
+    push(dword [eax]);
+    push(reg_mrb);
+    call((void *) mrbjit_exec_string);
+    add(reg_sp, sizeof(mrb_state *) + sizeof(mrb_value));
+
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    gen_store_cret(dstoff);
+    return code;
+  }
+
+  /* Receiver is modified in place, so reginfo is kept */
+  const void *
+    emit_strcat(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code **ppc = status->pc;
+    int dstoff = GETARG_A(**ppc) * sizeof(mrb_value);
+    int srcoff = GETARG_B(**ppc) * sizeof(mrb_value);
+
+#ifdef XBYAK64
+    mov(rdx, qword [reg_regs + srcoff]);
+    mov(rsi, qword [reg_regs + dstoff]);
+    mov(rdi, reg_mrb);
+    gen_call((void *) mrbjit_exec_strcat);
+#else
+    push(reg_regs);
+    push(reg_vms);
+
+    push(dword [reg_regs + srcoff + 4]);
+    push(dword [reg_regs + srcoff]);
+    push(dword [reg_regs + dstoff + 4]);
+    push(dword [reg_regs + dstoff]);
+    push(reg_mrb);
+    call((void *) mrbjit_exec_strcat);
+    add(reg_sp, sizeof(mrb_state *) + 2 * sizeof(mrb_value));
+
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    return code;
+  }
+
+  const void *
+    emit_hash(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi)
+  {
+    const void *code = getCurr();
+    mrb_code **ppc = status->pc;
+    int dstoff = GETARG_A(**ppc) * sizeof(mrb_value);
+    int srcoff = GETARG_B(**ppc) * sizeof(mrb_value);
+    int siz = GETARG_C(**ppc);
+    mrbjit_reginfo *dinfo = &coi->reginfo[GETARG_A(**ppc)];
+    dinfo->type = MRB_TT_HASH;
+    dinfo->klass = mrb->hash_class;
+    dinfo->constp = 0;
+
+#ifdef XBYAK64
+    mov(edx, siz);
+    lea(rsi, ptr [reg_regs + srcoff]);
+    mov(rdi, reg_mrb);
+    gen_call((void *) mrbjit_exec_hash);
+#else
+    push(reg_regs);
+    push(reg_vms);
+
+    mov(eax, siz);
+    push(eax);
+    lea(eax, ptr [reg_regs + srcoff]);
+    push(eax);
+    push(reg_mrb);
+    call((void *) mrbjit_exec_hash);
+    add(reg_sp, sizeof(mrb_state *) + sizeof(mrb_value *) + sizeof(int));
+
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
 
-    mov(ptr [ecx + dstoff], eax);
-    mov(ptr [ecx + dstoff + 4], edx);
+    gen_store_cret(dstoff);
     return code;
   }
 
@@ -1566,16 +3214,16 @@ do {                                                                 \
     dinfo->klass = NULL;
     dinfo->constp = 0;
 
-    mov(eax, dword [edi + OffsetOf(mrb_context, ci)]);
-    mov(eax, dword [eax + OffsetOf(mrb_callinfo, proc)]);
-    mov(eax, dword [eax + OffsetOf(struct RProc, env)]);
+    mov(reg_tmp0, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(mrb_callinfo, proc)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RProc, env)]);
     for (i = 0; i < uppos; i++) {
-      mov(eax, dword [eax + OffsetOf(struct REnv, c)]);
+      mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct REnv, c)]);
     }
-    mov(eax, dword [eax + OffsetOf(struct REnv, stack)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct REnv, stack)]);
 
-    movsd(xmm0, ptr [eax + idxpos * sizeof(mrb_value)]);
-    movsd(ptr [ecx + dstoff], xmm0);
+    movsd(xmm0, ptr [reg_tmp0 + idxpos * sizeof(mrb_value)]);
+    movsd(ptr [reg_regs + dstoff], xmm0);
 
     return code;
   }
@@ -1590,16 +3238,16 @@ do {                                                                 \
     const Xbyak::uint32 valoff = GETARG_A(**ppc) * sizeof(mrb_value);
     Xbyak::uint32 i;
 
-    mov(eax, dword [edi + OffsetOf(mrb_context, ci)]);
-    mov(eax, dword [eax + OffsetOf(mrb_callinfo, proc)]);
-    mov(eax, dword [eax + OffsetOf(struct RProc, env)]);
+    mov(reg_tmp0, ptr [reg_context + OffsetOf(mrb_context, ci)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(mrb_callinfo, proc)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct RProc, env)]);
     for (i = 0; i < uppos; i++) {
-      mov(eax, dword [eax + OffsetOf(struct REnv, c)]);
+      mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct REnv, c)]);
     }
-    mov(eax, dword [eax + OffsetOf(struct REnv, stack)]);
+    mov(reg_tmp0, ptr [reg_tmp0 + OffsetOf(struct REnv, stack)]);
 
-    movsd(xmm0, ptr [ecx + valoff]);
-    movsd(ptr [eax + idxpos * sizeof(mrb_value)], xmm0);
+    movsd(xmm0, ptr [reg_regs + valoff]);
+    movsd(ptr [reg_tmp0 + idxpos * sizeof(mrb_value)], xmm0);
 
     return code;
   }
@@ -1609,7 +3257,60 @@ do {                                                                 \
   {
     const void *code = getCurr();
     mrb_code **ppc = status->pc;
-    gen_jmp(mrb, status, *ppc, *ppc + GETARG_sBx(**ppc));
+    gen_jmp(mrb, status, coi, *ppc, *ppc + GETARG_sBx(**ppc));
+    return code;
+  }
+
+  /* Conditional jump by flags of the comparison just before.
+     Boolean value is made only on side exit, or when it is read later.
+     Code out of the trace enters at the returned address and tests
+     boolean in memory as usual. */
+  const void *
+    gen_fused_jmp(mrb_state *mrb, mrbjit_vmstatus *status, mrbjit_code_info *coi, mrb_value *regs, int jmpif)
+  {
+    const void *code;
+    mrb_code **ppc = status->pc;
+    mrb_irep *irep = *status->irep;
+    const int cond = GETARG_A(**ppc);
+    const Xbyak::uint32 coff =  cond * sizeof(mrb_value);
+    mrb_code *target = *ppc + GETARG_sBx(**ppc);
+    enum mrbjit_cc cc = cmp_pending_cc;
+    enum mrbjit_cc taken_cc = (enum mrbjit_cc)(jmpif ? cc : cc ^ 1);
+    int taken = jmpif ? mrb_test(regs[cond]) : !mrb_test(regs[cond]);
+    enum mrbjit_cc cont_cc = (enum mrbjit_cc)(taken ? taken_cc : taken_cc ^ 1);
+    mrb_code *cont_pc = taken ? target : *ppc + 1;
+
+    cmp_pending_clear();
+
+    inLocalLabel();
+    jmp(".fused", T_NEAR);
+
+    code = getCurr();
+    gen_regcache_reload();
+    mov(eax, ptr [reg_regs + coff + 4]);
+    if (taken) {
+      gen_bool_guard(mrb, jmpif, *ppc + 1, status);
+    }
+    else {
+      gen_bool_guard(mrb, !jmpif, target, status);
+    }
+    jmp(".cont", T_NEAR);
+
+    L(".fused");
+    gen_jcc(cont_cc, "@f");
+    gen_bool_value(cc, cond);
+    gen_exit(taken ? *ppc + 1 : target, 1, 0, status);
+    L("@@");
+    if (!reg_dead_p(irep, cont_pc, cond)) {
+      gen_bool_value(cc, cond);
+    }
+
+    L(".cont");
+    if (taken) {
+      gen_jmp(mrb, status, coi, *ppc, target);
+    }
+    outLocalLabel();
+
     return code;
   }
 
@@ -1621,10 +3322,14 @@ do {                                                                 \
     const int cond = GETARG_A(**ppc);
     const Xbyak::uint32 coff =  cond * sizeof(mrb_value);
     
-    mov(eax, ptr [ecx + coff + 4]);
+    if (cmp_pending_used_p(**ppc)) {
+      return gen_fused_jmp(mrb, status, coi, regs, 1);
+    }
+
+    mov(eax, ptr [reg_regs + coff + 4]);
     if (mrb_test(regs[cond])) {
       gen_bool_guard(mrb, 1, *ppc + 1, status);
-      gen_jmp(mrb, status, *ppc, *ppc + GETARG_sBx(**ppc));
+      gen_jmp(mrb, status, coi, *ppc, *ppc + GETARG_sBx(**ppc));
     }
     else {
       gen_bool_guard(mrb, 0, *ppc + GETARG_sBx(**ppc), status);
@@ -1641,10 +3346,14 @@ do {                                                                 \
     const int cond = GETARG_A(**ppc);
     const Xbyak::uint32 coff =  cond * sizeof(mrb_value);
     
-    mov(eax, ptr [ecx + coff + 4]);
+    if (cmp_pending_used_p(**ppc)) {
+      return gen_fused_jmp(mrb, status, coi, regs, 0);
+    }
+
+    mov(eax, ptr [reg_regs + coff + 4]);
     if (!mrb_test(regs[cond])) {
       gen_bool_guard(mrb, 0, *ppc + 1, status);
-      gen_jmp(mrb, status, *ppc, *ppc + GETARG_sBx(**ppc));
+      gen_jmp(mrb, status, coi, *ppc, *ppc + GETARG_sBx(**ppc));
     }
     else {
       gen_bool_guard(mrb, 1, *ppc + GETARG_sBx(**ppc), status);
@@ -1674,54 +3383,68 @@ do {                                                                 \
       for (i = -1; c->proc_pool[i].proc.tt == MRB_TT_PROC; i--) {
 	if (c->proc_pool[i].proc.body.irep == mirep) {
 	  struct RProc *nproc = &c->proc_pool[i].proc;
-	  mov(dword [ecx + dstoff], (Xbyak::uint32)nproc);
-	  mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_PROC);
+	  mrb_value pv = mrb_obj_value(nproc);
+	  mov(dword [reg_regs + dstoff], (Xbyak::uint32)pv.value.i);
+	  mov(dword [reg_regs + dstoff + 4], pv.value.ttt);
 	  /* mov(edx, (Xbyak::uint32)nproc->env);
-	     mov(dword [edx + OffsetOf(struct REnv, stack)], ecx);
-	     mov(eax, dword [esi + OffsetOf(mrb_state, c)]);
+	     mov(dword [edx + OffsetOf(struct REnv, stack)], reg_regs);
+	     mov(eax, dword [reg_mrb + OffsetOf(mrb_state, c)]);
 	     mov(eax, dword [eax + OffsetOf(mrb_context, ci)]);
 	     mov(eax, dword [eax + OffsetOf(mrb_callinfo, proc)]);
 	     mov(eax, dword [eax + OffsetOf(struct RProc, env)]);
 	     mov(dword [edx + OffsetOf(struct REnv, c)], eax); */
 
-	  /*	  mov(eax, dword [ecx + dstoff + 4]);
+	  /*	  mov(eax, dword [reg_regs + dstoff + 4]);
 		  push(eax);
-		  mov(eax, dword [ecx + dstoff]);
+		  mov(eax, dword [reg_regs + dstoff]);
 		  push(eax);
-		  push(esi);
+		  push(reg_mrb);
 		  call((void *)mrb_p);
-		  add(esp, 12);*/
+		  add(reg_sp, 12);*/
 
 	  return code;
 	}
       }
     }
 
-    mov(eax, ptr [esi + OffsetOf(mrb_state, arena_idx)]);
+    mov(eax, dword [reg_mrb + OffsetOf(mrb_state, arena_idx)]);
+#ifdef XBYAK64
+    push(rax);
+    sub(rsp, 8);
+    mov(rsi, (size_t)mirep);
+    mov(rdi, reg_mrb);
+    if (flags & OP_L_CAPTURE) {
+      gen_call((void *) mrb_closure_new);
+    }
+    else {
+      gen_call((void *) mrb_proc_new);
+    }
+    add(rsp, 8);
+#else
     push(eax);
-    push(ecx);
-    push(ebx);
+    push(reg_regs);
+    push(reg_vms);
     mov(eax, (Xbyak::uint32)mirep);
     push(eax);
-    push(esi);
+    push(reg_mrb);
     if (flags & OP_L_CAPTURE) {
       call((void *) mrb_closure_new);
     }
     else {
       call((void *) mrb_proc_new);
     }
-    add(esp, 2 * sizeof(void *));
-    pop(ebx);
-    pop(ecx);
-    mov(dword [ecx + dstoff], eax);
-    mov(dword [ecx + dstoff + 4], 0xfff00000 | MRB_TT_PROC);
+    add(reg_sp, 2 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+    gen_store_ptr_value(dstoff, reg_tmp0, MRB_TT_PROC);
     if (flags & OP_L_STRICT) {
       mov(edx, (Xbyak::uint32)MRB_PROC_STRICT);
       shl(edx, 11);
-      or(ptr [eax], edx);
+      or(dword [reg_tmp0], edx);
     }
-    pop(eax);
-    mov(ptr [esi + OffsetOf(mrb_state, arena_idx)], eax);
+    pop(reg_tmp0);
+    mov(dword [reg_mrb + OffsetOf(mrb_state, arena_idx)], eax);
     return code;
   }
 
@@ -1739,28 +3462,35 @@ do {                                                                 \
     dinfo->klass = mrb_class(mrb, 
 			     mrb_vm_const_get(mrb, mrb_intern_cstr(mrb, "Range")));
 
-    push(ecx);
-    push(ebx);
+#ifdef XBYAK64
+    mov(ecx, exelp);
+    mov(rdx, qword [reg_regs + srcoff1]);
+    mov(rsi, qword [reg_regs + srcoff0]);
+    mov(rdi, reg_mrb);
+    gen_call((void *) mrb_range_new);
+#else
+    push(reg_regs);
+    push(reg_vms);
 
     mov(eax, exelp);
     push(eax);
-    mov(eax, ptr [ecx + srcoff1 + 4]);
+    mov(eax, ptr [reg_regs + srcoff1 + 4]);
     push(eax);
-    mov(eax, ptr [ecx + srcoff1]);
+    mov(eax, ptr [reg_regs + srcoff1]);
     push(eax);
-    mov(eax, ptr [ecx + srcoff0 + 4]);
+    mov(eax, ptr [reg_regs + srcoff0 + 4]);
     push(eax);
-    mov(eax, ptr [ecx + srcoff0]);
+    mov(eax, ptr [reg_regs + srcoff0]);
     push(eax);
-    push(esi);
+    push(reg_mrb);
     call((void *) mrb_range_new);
-    add(esp, sizeof(mrb_state *) + sizeof(mrb_value) * 2 + sizeof(int));
+    add(reg_sp, sizeof(mrb_state *) + sizeof(mrb_value) * 2 + sizeof(int));
     
-    pop(ebx);
-    pop(ecx);
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
 
-    mov(ptr [ecx + dstoff], eax);
-    mov(ptr [ecx + dstoff + 4], edx);
+    gen_store_cret(dstoff);
     return code;
   }
 
@@ -1783,6 +3513,59 @@ do {                                                                 \
   mrb_value 
     mrbjit_prim_ary_aset_impl(mrb_state *mrb, mrb_value proc,
 			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  void
+    gen_ary_end(int regno, int last, int pop);
+  mrb_value
+    mrbjit_prim_ary_size_impl(mrb_state *mrb, mrb_value proc,
+			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_ary_empty_p_impl(mrb_state *mrb, mrb_value proc,
+				 mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_ary_first_impl(mrb_state *mrb, mrb_value proc,
+			       mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_ary_last_impl(mrb_state *mrb, mrb_value proc,
+			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_ary_pop_impl(mrb_state *mrb, mrb_value proc,
+			     mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_ary_push_impl(mrb_state *mrb, mrb_value proc,
+			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  void
+    gen_hash_lookup(mrb_state *mrb, int regno, mrbjit_vmstatus *status,
+		    mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_hash_aget_impl(mrb_state *mrb, mrb_value proc,
+			       mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_hash_aset_impl(mrb_state *mrb, mrb_value proc,
+			       mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_hash_has_key_impl(mrb_state *mrb, mrb_value proc,
+				  mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  void
+    gen_flo_to_fix(mrb_state *mrb, int regno, enum mrbjit_flo_round mode,
+		   mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_flo_floor_impl(mrb_state *mrb, mrb_value proc,
+			       mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_flo_ceil_impl(mrb_state *mrb, mrb_value proc,
+			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_flo_round_impl(mrb_state *mrb, mrb_value proc,
+			       mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_flo_truncate_impl(mrb_state *mrb, mrb_value proc,
+				  mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_num_abs_impl(mrb_state *mrb, mrb_value proc,
+			     mrbjit_vmstatus *status, mrbjit_code_info *coi);
+  mrb_value
+    mrbjit_prim_num_pow_impl(mrb_state *mrb, mrb_value proc,
+			     mrbjit_vmstatus *status, mrbjit_code_info *coi);
   mrb_value 
     mrbjit_prim_fix_to_f_impl(mrb_state *mrb, mrb_value proc,
 			      mrbjit_vmstatus *status, mrbjit_code_info *coi);
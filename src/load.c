@@ -172,16 +172,9 @@ read_irep_record_1(mrb_state *mrb, const uint8_t *bin, size_t *len, mrb_bool all
   *len = (size_t)diff;
 
   // JIT Block
-  irep->jit_entry_tab = (mrbjit_codetab *)mrb_calloc(mrb, irep->ilen, sizeof(mrbjit_codetab));
-  for (i = 0; i < irep->ilen; i++) {
-    irep->jit_entry_tab[i].size = 2;
-    irep->jit_entry_tab[i].body = 
-      (mrbjit_code_info *)mrb_calloc(mrb, 2, sizeof(mrbjit_code_info));
-  }
-  irep->prof_info = (int *)mrb_calloc(mrb, 1, sizeof(int)*irep->ilen);
+  mrbjit_make_jit_prof(mrb, irep);
   irep->method_kind = NORMAL;
   irep->jit_inlinep = 0;
-  irep->jit_top_entry = NULL;
 
   irep->simple_lambda = 1;
   irep->proc_obj = NULL;
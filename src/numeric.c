@@ -1327,6 +1327,10 @@ mrb_init_numeric(mrb_state *mrb)
   numeric = mrb_define_class(mrb, "Numeric",  mrb->object_class);
 
   mrb_define_method(mrb, numeric, "**",       num_pow,        MRB_ARGS_REQ(1));
+  mrbjit_define_primitive(mrb, numeric, "**", mrbjit_prim_num_pow);
+  /* abs is defined in mrblib */
+  mrbjit_define_primitive(mrb, numeric, "abs", mrbjit_prim_num_abs);
+
   mrb_define_method(mrb, numeric, "/",        num_div,        MRB_ARGS_REQ(1));  /* 15.2.8.3.4  */
   mrb_define_method(mrb, numeric, "quo",      num_div,        MRB_ARGS_REQ(1));  /* 15.2.7.4.5 (x) */
   mrb_define_method(mrb, numeric, "<=>",      num_cmp,        MRB_ARGS_REQ(1));  /* 15.2.9.3.6  */
@@ -1373,14 +1377,26 @@ mrb_init_numeric(mrb_state *mrb)
   mrb_define_method(mrb, fl,      "%",         flo_mod,          MRB_ARGS_REQ(1)); /* 15.2.9.3.5  */
   mrb_define_method(mrb, fl,      "==",        flo_eq,           MRB_ARGS_REQ(1)); /* 15.2.9.3.7  */
   mrb_define_method(mrb, fl,      "ceil",      flo_ceil,         MRB_ARGS_NONE()); /* 15.2.9.3.8  */
+  mrbjit_define_primitive(mrb, fl, "ceil", mrbjit_prim_flo_ceil);
+
   mrb_define_method(mrb, fl,      "finite?",   flo_finite_p,     MRB_ARGS_NONE()); /* 15.2.9.3.9  */
   mrb_define_method(mrb, fl,      "floor",     flo_floor,        MRB_ARGS_NONE()); /* 15.2.9.3.10 */
+  mrbjit_define_primitive(mrb, fl, "floor", mrbjit_prim_flo_floor);
+
   mrb_define_method(mrb, fl,      "infinite?", flo_infinite_p,   MRB_ARGS_NONE()); /* 15.2.9.3.11 */
   mrb_define_method(mrb, fl,      "round",     flo_round,        MRB_ARGS_NONE()); /* 15.2.9.3.12 */
+  mrbjit_define_primitive(mrb, fl, "round", mrbjit_prim_flo_round);
+
   mrb_define_method(mrb, fl,      "to_f",      flo_to_f,         MRB_ARGS_NONE()); /* 15.2.9.3.13 */
   mrb_define_method(mrb, fl,      "to_i",      flo_truncate,     MRB_ARGS_NONE()); /* 15.2.9.3.14 */
+  mrbjit_define_primitive(mrb, fl, "to_i", mrbjit_prim_flo_truncate);
+
   mrb_define_method(mrb, fl,      "to_int",    flo_truncate,     MRB_ARGS_NONE());
+  mrbjit_define_primitive(mrb, fl, "to_int", mrbjit_prim_flo_truncate);
+
   mrb_define_method(mrb, fl,      "truncate",  flo_truncate,     MRB_ARGS_NONE()); /* 15.2.9.3.15 */
+  mrbjit_define_primitive(mrb, fl, "truncate", mrbjit_prim_flo_truncate);
+
   mrb_define_method(mrb, fl,      "divmod",    flo_divmod,       MRB_ARGS_REQ(1));
 
   mrb_define_method(mrb, fl,      "to_s",      flo_to_s,         MRB_ARGS_NONE()); /* 15.2.9.3.16(x) */
@@ -3,9 +3,13 @@ extern "C" {
 #include "mruby.h"
 #include "mruby/primitive.h"
 #include "mruby/array.h"
+#include "mruby/hash.h"
+#include "mruby/khash.h"
 #include "mruby/irep.h"
 #include "opcode.h"
 
+KHASH_DECLARE(ht, mrb_value, mrb_value, 1)
+
 mrb_value
 mrbjit_instance_alloc(mrb_state *mrb, mrb_value cv)
 {
@@ -35,7 +39,7 @@ MRBJitCode::mrbjit_prim_num_cmp_impl(mrb_state *mrb, mrb_value proc,
   const Xbyak::uint32 off1 = off0 + sizeof(mrb_value);
   mrbjit_reginfo *dinfo = &coi->reginfo[regno];
   // not need guard for self because guard geneate already
-  //mov(eax, dword [ecx + off0 + 4]);
+  //mov(eax, dword [reg_regs + off0 + 4]);
   //gen_type_guard(mrb, (enum mrb_vtype)mrb_type(regs[regno]), pc);
 
   gen_type_guard(mrb, regno, status, pc, coi);
@@ -43,28 +47,28 @@ MRBJitCode::mrbjit_prim_num_cmp_impl(mrb_state *mrb, mrb_value proc,
   
   if (mrb_type(regs[regno]) == MRB_TT_FLOAT &&
       mrb_type(regs[regno + 1]) == MRB_TT_FIXNUM) {
-    movsd(xmm0, ptr [ecx + off0]);
-    cvtsi2sd(xmm1, ptr [ecx + off1]);
+    movsd(xmm0, ptr [reg_regs + off0]);
+    cvtsi2sd(xmm1, ptr [reg_regs + off1]);
     comisd(xmm0, xmm1);
   }
   else if (mrb_type(regs[regno]) == MRB_TT_FIXNUM &&
 	   mrb_type(regs[regno + 1]) == MRB_TT_FLOAT) {
-    cvtsi2sd(xmm0, ptr [ecx + off0]);
-    movsd(xmm1, ptr [ecx + off1]);
+    cvtsi2sd(xmm0, ptr [reg_regs + off0]);
+    movsd(xmm1, ptr [reg_regs + off1]);
     comisd(xmm0, xmm1);
   }
   else if (mrb_type(regs[regno]) == MRB_TT_FLOAT &&
 	   mrb_type(regs[regno + 1]) == MRB_TT_FLOAT) {
-    movsd(xmm0, ptr [ecx + off0]);
-    movsd(xmm1, ptr [ecx + off1]);
+    movsd(xmm0, ptr [reg_regs + off0]);
+    movsd(xmm1, ptr [reg_regs + off1]);
     comisd(xmm0, xmm1);
   }
   else {
-    cvtsi2sd(xmm0, ptr [ecx + off0]);
-    cvtsi2sd(xmm1, ptr [ecx + off1]);
+    cvtsi2sd(xmm0, ptr [reg_regs + off0]);
+    cvtsi2sd(xmm1, ptr [reg_regs + off1]);
     comisd(xmm0, xmm1);
     /*    mov(eax, dword [ecx + off0]);
-	  cmp(eax, dword [ecx + off1]);*/
+	  cmp(eax, dword [reg_regs + off1]);*/
   }
 
   inLocalLabel();
@@ -87,8 +91,8 @@ MRBJitCode::mrbjit_prim_num_cmp_impl(mrb_state *mrb, mrb_value proc,
   L(".cmpend");
   outLocalLabel();
 
-  mov(dword [ecx + off0], eax);
-  mov(dword [ecx + off0 + 4], 0xfff80000 | MRB_TT_FIXNUM);
+  mov(dword [reg_regs + off0], eax);
+  mov(dword [reg_regs + off0 + 4], mrb_mktt(MRB_TT_FIXNUM));
   dinfo->type = MRB_TT_FIXNUM;
   dinfo->klass = mrb->fixnum_class;
 
@@ -114,7 +118,7 @@ MRBJitCode::mrbjit_prim_fix_succ_impl(mrb_state *mrb, mrb_value proc,
   const Xbyak::uint32 off0 = regno * sizeof(mrb_value);
   mrbjit_reginfo *dinfo = &coi->reginfo[regno];
 
-  add(dword [ecx + off0], 1);
+  add(dword [reg_regs + off0], 1);
   dinfo->type = MRB_TT_FIXNUM;
   dinfo->klass = mrb->fixnum_class;
 
@@ -149,17 +153,17 @@ MRBJitCode::mrbjit_prim_fix_mod_impl(mrb_state *mrb, mrb_value proc,
 
   gen_type_guard(mrb, regno + 1, status, pc, coi);
 
-  mov(eax, ptr [ecx + off0]);
+  mov(eax, ptr [reg_regs + off0]);
   mov(edx, eax);
-  sar(edx, (sizeof(void *) * 8) - 1);
-  idiv(ptr [ecx + off1]);
+  sar(edx, 31);
+  idiv(ptr [reg_regs + off1]);
   test(eax, eax);
   setl(al);
   and(eax, 1);
   neg(eax);
   xor(edx, eax);
   sub(edx, eax);
-  mov(ptr [ecx + off0], edx);
+  mov(ptr [reg_regs + off0], edx);
 
   dinfo->type = MRB_TT_FLOAT;
   dinfo->klass = mrb->float_class;
@@ -184,9 +188,9 @@ MRBJitCode::mrbjit_prim_fix_to_f_impl(mrb_state *mrb, mrb_value proc,
   const Xbyak::uint32 off0 = regno * sizeof(mrb_value);
   mrbjit_reginfo *dinfo = &coi->reginfo[regno];
 
-  mov(eax, dword [ecx + off0]);
+  mov(eax, dword [reg_regs + off0]);
   cvtsi2sd(xmm0, eax);
-  movsd(ptr [ecx + off0], xmm0);
+  movsd(ptr [reg_regs + off0], xmm0);
   dinfo->type = MRB_TT_FLOAT;
   dinfo->klass = mrb->float_class;
 
@@ -201,6 +205,335 @@ mrbjit_prim_fix_to_f(mrb_state *mrb, mrb_value proc, void *status, void *coi)
   return code->mrbjit_prim_fix_to_f_impl(mrb, proc, (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
 }
 
+/* regs[regno] = Fixnum of Float in regs[regno] rounded like flo_floor,
+   flo_ceil, flo_round or flo_truncate. cvttsd2si truncates and the
+   result is adjusted by comparing with the source, so SSE2 is enough.
+   Exit to VM if the result is not FIXABLE (the method returns Float) */
+void
+MRBJitCode::gen_flo_to_fix(mrb_state *mrb, int regno, enum mrbjit_flo_round mode,
+			   mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  const Xbyak::uint32 off = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  inLocalLabel();
+  movsd(xmm0, ptr [reg_regs + off]);
+  /* 0x80000000 is returned for NaN, infinity and out of range too */
+  cvttsd2si(eax, xmm0);
+  cmp(eax, 0x80000000);
+  jz(".overflow");
+  cvtsi2sd(xmm1, eax);
+
+  switch (mode) {
+  case MRBJIT_FLO_FLOOR:
+    comisd(xmm1, xmm0);
+    jbe(".fixnum");
+    dec(eax);
+    break;
+
+  case MRBJIT_FLO_CEIL:
+    comisd(xmm0, xmm1);
+    jbe(".fixnum");
+    inc(eax);
+    jo(".overflow");
+    break;
+
+  case MRBJIT_FLO_ROUND:
+    /* x - trunc(x) is exact and in (-1, 1), so truncated 2 * (x -
+       trunc(x)) is -1, 0 or 1 as round half away from zero needs */
+    subsd(xmm0, xmm1);
+    addsd(xmm0, xmm0);
+    cvttsd2si(edx, xmm0);
+    add(eax, edx);
+    jo(".overflow");
+    break;
+
+  case MRBJIT_FLO_TRUNCATE:
+    break;
+  }
+
+  L(".fixnum");
+  mov(dword [reg_regs + off], eax);
+  mov(dword [reg_regs + off + 4], mrb_mktt(MRB_TT_FIXNUM));
+  jmp(".exit");
+
+  L(".overflow");
+  gen_exit(*status->pc, 1, 0, status, MRBJIT_EXIT_TYPE);
+
+  L(".exit");
+  outLocalLabel();
+  dinfo->type = MRB_TT_FIXNUM;
+  dinfo->klass = mrb->fixnum_class;
+  dinfo->constp = 0;
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_flo_floor_impl(mrb_state *mrb, mrb_value proc,
+				       mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+
+  if (GETARG_C(i) != 0 ||
+      mrb_type((*status->regs)[regno]) != MRB_TT_FLOAT) {
+    return mrb_nil_value();
+  }
+
+  gen_flo_to_fix(mrb, regno, MRBJIT_FLO_FLOOR, status, coi);
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_flo_floor(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_flo_floor_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_flo_ceil_impl(mrb_state *mrb, mrb_value proc,
+				      mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+
+  if (GETARG_C(i) != 0 ||
+      mrb_type((*status->regs)[regno]) != MRB_TT_FLOAT) {
+    return mrb_nil_value();
+  }
+
+  gen_flo_to_fix(mrb, regno, MRBJIT_FLO_CEIL, status, coi);
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_flo_ceil(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_flo_ceil_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_flo_round_impl(mrb_state *mrb, mrb_value proc,
+				       mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+
+  if (GETARG_C(i) != 0 ||
+      mrb_type((*status->regs)[regno]) != MRB_TT_FLOAT) {
+    return mrb_nil_value();
+  }
+
+  gen_flo_to_fix(mrb, regno, MRBJIT_FLO_ROUND, status, coi);
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_flo_round(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_flo_round_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_flo_truncate_impl(mrb_state *mrb, mrb_value proc,
+					  mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+
+  if (GETARG_C(i) != 0 ||
+      mrb_type((*status->regs)[regno]) != MRB_TT_FLOAT) {
+    return mrb_nil_value();
+  }
+
+  gen_flo_to_fix(mrb, regno, MRBJIT_FLO_TRUNCATE, status, coi);
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_flo_truncate(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_flo_truncate_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* Numeric#abs (written in Ruby) of Fixnum and Float. Float keeps
+   "self < 0 ? -self : self", so -0.0 and NaN are not changed */
+mrb_value
+MRBJitCode::mrbjit_prim_num_abs_impl(mrb_state *mrb, mrb_value proc,
+				     mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 off = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();
+  }
+
+  switch (mrb_type((*status->regs)[regno])) {
+  case MRB_TT_FIXNUM:
+    inLocalLabel();
+    mov(eax, dword [reg_regs + off]);
+    mov(edx, eax);
+    sar(edx, 31);
+    xor(eax, edx);
+    sub(eax, edx);
+    jno(".exit");
+    /* -MRB_INT_MIN is Float */
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_TYPE);
+    L(".exit");
+    outLocalLabel();
+    mov(dword [reg_regs + off], eax);
+    break;
+
+  case MRB_TT_FLOAT:
+    movsd(xmm0, ptr [reg_regs + off]);
+    xorpd(xmm1, xmm1);
+    comisd(xmm1, xmm0);
+    jbe("@f");
+    xor(dword [reg_regs + off + 4], 0x80000000);
+    L("@@");
+    break;
+
+  default:
+    return mrb_nil_value();
+  }
+
+  dinfo->constp = 0;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_num_abs(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_num_abs_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* Numeric#** of a literal Fixnum exponent by power-by-squaring. Float
+   base supports exponent up to 2, because more multiplications round
+   more than once and may differ from pow(). Fixnum base exits to VM on
+   overflow (the result is Float) */
+mrb_value
+MRBJitCode::mrbjit_prim_num_pow_impl(mrb_state *mrb, mrb_value proc,
+				     mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 off0 = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+  mrb_value base = (*status->regs)[regno];
+  mrb_value ex = (*status->regs)[regno + 1];
+  int n;
+
+  if (GETARG_C(i) != 1 || !coi->reginfo[regno + 1].constp ||
+      mrb_type(ex) != MRB_TT_FIXNUM || mrb_fixnum(ex) < 0) {
+    return mrb_nil_value();
+  }
+  n = mrb_fixnum(ex);
+
+  switch (mrb_type(base)) {
+  case MRB_TT_FIXNUM:
+    if (n > 31) {
+      return mrb_nil_value();
+    }
+    break;
+
+  case MRB_TT_FLOAT:
+    if (n > 2) {
+      return mrb_nil_value();
+    }
+    break;
+
+  default:
+    return mrb_nil_value();
+  }
+
+  /* constp doesn't promise the value is fixed, so the exponent is
+     compared with the one the code is made for */
+  gen_type_guard(mrb, regno + 1, status, pc, coi);
+  cmp(dword [reg_regs + off0 + sizeof(mrb_value)], n);
+  jz("@f");
+  gen_exit(pc, 1, 0, status);
+  L("@@");
+
+  switch (mrb_type(base)) {
+  case MRB_TT_FIXNUM:
+    inLocalLabel();
+    mov(eax, 1);
+    mov(edx, dword [reg_regs + off0]);
+    while (n) {
+      if (n & 1) {
+	imul(eax, edx);
+	jo(".overflow");
+      }
+      n >>= 1;
+      if (n) {
+	imul(edx, edx);
+	jo(".overflow");
+      }
+    }
+    mov(dword [reg_regs + off0], eax);
+    jmp(".exit");
+
+    L(".overflow");
+    gen_exit(pc, 1, 0, status, MRBJIT_EXIT_TYPE);
+
+    L(".exit");
+    outLocalLabel();
+    break;
+
+  case MRB_TT_FLOAT:
+    if (n == 0) {
+      /* pow(x, 0) is 1 even if x is NaN */
+      mov(eax, 1);
+      cvtsi2sd(xmm0, eax);
+      movsd(ptr [reg_regs + off0], xmm0);
+    }
+    else if (n == 2) {
+      movsd(xmm0, ptr [reg_regs + off0]);
+      mulsd(xmm0, xmm0);
+      movsd(ptr [reg_regs + off0], xmm0);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  dinfo->constp = 0;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_num_pow(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_num_pow_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
 mrb_value
 MRBJitCode::mrbjit_prim_obj_not_equal_m_impl(mrb_state *mrb, mrb_value proc,
 					     mrbjit_vmstatus *status, mrbjit_code_info *coi)
@@ -208,7 +541,7 @@ MRBJitCode::mrbjit_prim_obj_not_equal_m_impl(mrb_state *mrb, mrb_value proc,
   mrb_code **ppc = status->pc;
   mrb_value *regs = *status->regs;
 
-  COMP_GEN(setnz, setnz);
+  COMP_GEN(MRBJIT_CC_NZ, MRBJIT_CC_NZ);
 
   return mrb_true_value();
 }
@@ -241,26 +574,26 @@ MRBJitCode::mrbjit_prim_ary_aget_impl(mrb_state *mrb, mrb_value proc,
   inLocalLabel();
   gen_class_guard(mrb, regno, status, pc, coi);
 
-  mov(edx, ptr [ecx + offary]);
-  mov(eax, ptr [ecx + offidx]);
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  mov(eax, dword [reg_regs + offidx]);
   test(eax, eax);
   jge(".normal");
-  add(eax, dword [edx + OffsetOf(struct RArray, len)]);
+  add(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
   jl(".retnil");
   L(".normal");
-  cmp(eax, dword [edx + OffsetOf(struct RArray, len)]);
+  cmp(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
   jge(".retnil");
-  mov(edx, dword [edx + OffsetOf(struct RArray, ptr)]);
-  test(edx, edx);
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RArray, ptr)]);
+  test(reg_tmp1, reg_tmp1);
   jz(".retnil");
-  movsd(xmm0, ptr [edx + eax * sizeof(mrb_value)]);
-  movsd(ptr [ecx + offary], xmm0);
+  movsd(xmm0, ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)]);
+  movsd(ptr [reg_regs + offary], xmm0);
   jmp(".exit");
 
   L(".retnil");
   xor(eax, eax);
-  mov(dword [ecx + offary], eax);
-  mov(dword [ecx + offary + 4], 0xfff00000 | MRB_TT_FALSE);
+  mov(dword [reg_regs + offary], eax);
+  mov(dword [reg_regs + offary + 4], mrb_mktt(MRB_TT_FALSE));
 
   L(".exit");
   outLocalLabel();
@@ -287,63 +620,718 @@ MRBJitCode::mrbjit_prim_ary_aset_impl(mrb_state *mrb, mrb_value proc,
   const Xbyak::uint32 offary = regno * sizeof(mrb_value);
   const Xbyak::uint32 offidx = offary + sizeof(mrb_value);
   const Xbyak::uint32 offval = offidx + sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
 
-  if (nargs != 2) {
-    return mrb_nil_value();    	// Support only 2 args(index, value)
+  // Support only 2 args(index, value) and Fixnum index
+  if ((nargs != 2) ||
+      (mrb_type((*status->regs)[regno + 1]) != MRB_TT_FIXNUM)) {
+    return mrb_nil_value();
   }
 
   inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_type_guard(mrb, regno + 1, status, pc, coi);
 
-  push(ecx);
-
-  mov(eax, ptr [ecx + offval + 4]);
-  push(eax);
-  mov(eax, ptr [ecx + offval]);
-  push(eax);
-
-  mov(edx, ptr [ecx + offary]);
-  mov(eax, ptr [ecx + offidx]);
+  /* Index out of range extends the array or raises IndexError in
+     mrb_ary_set */
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  mov(eax, dword [reg_regs + offidx]);
   test(eax, eax);
   jge(".normal");
-  add(eax, dword [edx + OffsetOf(struct RArray, len)]);
-  jl(".retnil");
+  add(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  jl(".extend");
   L(".normal");
-  cmp(eax, dword [edx + OffsetOf(struct RArray, len)]);
-  jg(".retnil");
+  cmp(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  jge(".extend");
+
+  /* Store in place if the body is not shared (flags is from bit 11
+     of the object header) */
+  test(dword [reg_tmp1], MRB_ARY_SHARED << 11);
+  jnz(".extend");
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RArray, ptr)]);
+  movsd(xmm0, ptr [reg_regs + offval]);
+  movsd(ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)], xmm0);
+  gen_write_barrier(offary, &coi->reginfo[regno + 2]);
+  jmp(".stored");
+
+  L(".extend");
+#ifdef XBYAK64
+  mov(rcx, qword [reg_regs + offval]);
+  mov(edx, dword [reg_regs + offidx]);
+  mov(rsi, qword [reg_regs + offary]);
+  mov(rdi, reg_mrb);
+  gen_call((void *)mrb_ary_set);
+#else
+  push(reg_regs);
+  push(reg_vms);
+  mov(edx, dword [reg_regs + offval + 4]);
+  push(edx);
+  mov(edx, dword [reg_regs + offval]);
+  push(edx);
+  mov(edx, dword [reg_regs + offidx]);
+  push(edx);
+  mov(edx, dword [reg_regs + offary + 4]);
+  push(edx);
+  mov(edx, dword [reg_regs + offary]);
+  push(edx);
+  push(reg_mrb);
+  call((void *)mrb_ary_set);
+  add(reg_sp, 2 * sizeof(void *) + 2 * sizeof(mrb_value));
+  pop(reg_vms);
+  pop(reg_regs);
+#endif
+  L(".stored");
+  movsd(xmm0, ptr [reg_regs + offval]);
+  movsd(ptr [reg_regs + offary], xmm0);
+  outLocalLabel();
+  *dinfo = coi->reginfo[regno + 2];
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_aset(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_aset_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_ary_size_impl(mrb_state *mrb, mrb_value proc,
+				      mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offary = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();
+  }
+
+  gen_class_guard(mrb, regno, status, pc, coi);
+
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  mov(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  mov(dword [reg_regs + offary], eax);
+  mov(dword [reg_regs + offary + 4], mrb_mktt(MRB_TT_FIXNUM));
+  dinfo->type = MRB_TT_FIXNUM;
+  dinfo->klass = mrb->fixnum_class;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_size(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_size_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_ary_empty_p_impl(mrb_state *mrb, mrb_value proc,
+					 mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offary = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();
+  }
+
+  inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  mov(dword [reg_regs + offary], 1);
+  cmp(dword [reg_tmp1 + OffsetOf(struct RArray, len)], 0);
+  jnz(".false");
+  mov(dword [reg_regs + offary + 4], mrb_mktt(MRB_TT_TRUE));
+  jmp(".exit");
+  L(".false");
+  mov(dword [reg_regs + offary + 4], mrb_mktt(MRB_TT_FALSE));
+  L(".exit");
+  outLocalLabel();
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_empty_p(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_empty_p_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* regs[regno] = first or last element of the array in regs[regno] (nil
+   if it is empty). pop removes the last element too */
+void
+MRBJitCode::gen_ary_end(int regno, int last, int pop)
+{
+  const Xbyak::uint32 offary = regno * sizeof(mrb_value);
+
+  inLocalLabel();
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  mov(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  test(eax, eax);
+  jz(".retnil");
+  if (last) {
+    dec(eax);
+  }
+  else {
+    xor(eax, eax);
+  }
+  if (pop) {
+    mov(dword [reg_tmp1 + OffsetOf(struct RArray, len)], eax);
+  }
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RArray, ptr)]);
+  movsd(xmm0, ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)]);
+  movsd(ptr [reg_regs + offary], xmm0);
+  jmp(".exit");
+
+  L(".retnil");
+  xor(eax, eax);
+  mov(dword [reg_regs + offary], eax);
+  mov(dword [reg_regs + offary + 4], mrb_mktt(MRB_TT_FALSE));
+
+  L(".exit");
+  outLocalLabel();
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_ary_first_impl(mrb_state *mrb, mrb_value proc,
+				       mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();    	// Support only no args
+  }
+
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_ary_end(regno, 0, 0);
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_first(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_first_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_ary_last_impl(mrb_state *mrb, mrb_value proc,
+				      mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();    	// Support only no args
+  }
+
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_ary_end(regno, 1, 0);
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_last(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_last_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* Same as mrb_ary_pop. Shared body is not copied because it is not
+   modified */
+mrb_value
+MRBJitCode::mrbjit_prim_ary_pop_impl(mrb_state *mrb, mrb_value proc,
+				     mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 0) {
+    return mrb_nil_value();
+  }
+
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_ary_end(regno, 1, 1);
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_pop(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_pop_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* Array#push and Array#<< of one element. mrb_ary_push is called to
+   grow or unshare the body */
+mrb_value
+MRBJitCode::mrbjit_prim_ary_push_impl(mrb_state *mrb, mrb_value proc,
+				      mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offary = regno * sizeof(mrb_value);
+  const Xbyak::uint32 offval = offary + sizeof(mrb_value);
+
+  if (GETARG_C(i) != 1) {
+    return mrb_nil_value();    	// Support only 1 arg
+  }
+
+  inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offary]);
+  /* flags is from bit 11 of the object header */
+  test(dword [reg_tmp1], MRB_ARY_SHARED << 11);
+  jnz(".slow");
+  mov(eax, dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  cmp(eax, dword [reg_tmp1 + OffsetOf(struct RArray, aux.capa)]);
+  jge(".slow");
+  inc(dword [reg_tmp1 + OffsetOf(struct RArray, len)]);
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RArray, ptr)]);
+  movsd(xmm0, ptr [reg_regs + offval]);
+  movsd(ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)], xmm0);
+  gen_write_barrier(offary, &coi->reginfo[regno + 1]);
+  jmp(".exit");
+
+  L(".slow");
+#ifdef XBYAK64
+  mov(rdx, qword [reg_regs + offval]);
+  mov(rsi, qword [reg_regs + offary]);
+  mov(rdi, reg_mrb);
+  gen_call((void *)mrb_ary_push);
+#else
+  push(reg_regs);
+  push(reg_vms);
+  push(dword [reg_regs + offval + 4]);
+  push(dword [reg_regs + offval]);
+  push(dword [reg_regs + offary + 4]);
+  push(dword [reg_regs + offary]);
+  push(reg_mrb);
+  call((void *)mrb_ary_push);
+  add(reg_sp, sizeof(void *) + 2 * sizeof(mrb_value));
+  pop(reg_vms);
+  pop(reg_regs);
+#endif
+
+  /* Return self, it is in regs[regno] already */
+  L(".exit");
+  outLocalLabel();
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_ary_push(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_ary_push_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+/* Probe the ht table of the Hash in regs[regno] for the Symbol or
+   Fixnum key in regs[regno + 1] like kh_get. Jump to .miss of the
+   caller if the key is not found, otherwise reg_tmp1 points the value.
+   Hash value of Symbol is read from sym_hash of compile_info and
+   mrbjit_sym_hash fills it at the first lookup of the Symbol.
+   Destroy reg_tmp0, rsi, r11 and caller saved registers. */
+void
+MRBJitCode::gen_hash_lookup(mrb_state *mrb, int regno, mrbjit_vmstatus *status,
+			    mrbjit_code_info *coi)
+{
+  const Xbyak::uint32 offhash = regno * sizeof(mrb_value);
+  const Xbyak::uint32 offkey = offhash + sizeof(mrb_value);
+  mrbjit_reginfo *kinfo = &coi->reginfo[regno + 1];
+  mrb_value key = (*status->regs)[regno + 1];
+
+  if (kinfo->constp) {
+    /* Key is likely a literal, so the hash value is computed now.
+       constp doesn't promise the value is fixed, so it is compared */
+    if (kinfo->type == MRB_TT_SYMBOL) {
+      cmp(word [reg_regs + offkey], (int)mrb_symbol(key));
+    }
+    else {
+      cmp(dword [reg_regs + offkey], (int)mrb_fixnum(key));
+    }
+    jnz(".hash");
+    mov(eax, mrb_hash_ht_hash(mrb, key));
+    jmp(".hashed");
+  }
+  L(".hash");
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    /* Cache the current key now, the loop likely uses it again */
+    mrbjit_sym_hash(mrb, mrb_symbol(key));
+    movzx(eax, word [reg_regs + offkey]);
+    cmp(eax, dword [reg_mrb + OffsetOf(mrb_state, compile_info.sym_hash_size)]);
+    jae(".hashcall");
+    mov(reg_tmp1, ptr [reg_mrb + OffsetOf(mrb_state, compile_info.sym_hash)]);
+    mov(eax, dword [reg_tmp1 + reg_tmp0 * sizeof(uint32_t)]);
+    test(eax, eax);
+    jnz(".hashed");
+    L(".hashcall");
+  }
+#ifdef XBYAK64
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    movzx(esi, word [reg_regs + offkey]);
+    mov(rdi, reg_mrb);
+    gen_call((void *)mrbjit_sym_hash);
+  }
+  else {
+    mov(rsi, qword [reg_regs + offkey]);
+    mov(rdi, reg_mrb);
+    gen_call((void *)mrb_hash_ht_hash);
+  }
+#else
+  push(reg_regs);
+  push(reg_vms);
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    movzx(eax, word [reg_regs + offkey]);
+    push(eax);
+    push(reg_mrb);
+    call((void *)mrbjit_sym_hash);
+    add(reg_sp, 2 * sizeof(void *));
+  }
+  else {
+    mov(eax, dword [reg_regs + offkey + 4]);
+    push(eax);
+    mov(eax, dword [reg_regs + offkey]);
+    push(eax);
+    push(reg_mrb);
+    call((void *)mrb_hash_ht_hash);
+    add(reg_sp, sizeof(void *) + sizeof(mrb_value));
+  }
+  pop(reg_vms);
+  pop(reg_regs);
+#endif
+  L(".hashed");
+
+#ifdef XBYAK64
+  mov(rsi, qword [reg_regs + offkey]);
+
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offhash]);
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RHash, ht)]);
+  test(reg_tmp1, reg_tmp1);
+  jz(".miss");
+  and(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, mask)]);
+  mov(r11, ptr [reg_tmp1 + OffsetOf(kh_ht_t, ed_flags)]);
+
+  /* Bit 2k + 1 of ed_flags is empty flag and bit 2k is deleted flag */
+  L(".loop");
+  lea(rcx, ptr [rax + rax + 1]);
+  bt(ptr [r11], rcx);
+  jc(".miss");
+  dec(rcx);
+  bt(ptr [r11], rcx);
+  jc(".next");
+  mov(rcx, ptr [reg_tmp1 + OffsetOf(kh_ht_t, keys)]);
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    /* mrb_sym is short and the rest of the value word is undefined */
+    cmp(word [rcx + rax * sizeof(mrb_value)], si);
+    jnz(".next");
+    cmp(dword [rcx + rax * sizeof(mrb_value) + 4], mrb_mktt(MRB_TT_SYMBOL));
+  }
+  else {
+    cmp(qword [rcx + rax * sizeof(mrb_value)], rsi);
+  }
+  jz(".found");
+
+  L(".next");
+  add(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, inc)]);
+  and(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, mask)]);
+  jmp(".loop");
+
+  L(".found");
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(kh_ht_t, vals)]);
+  lea(reg_tmp1, ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)]);
+#else
+  gen_load_ptr(reg_tmp1, ptr [reg_regs + offhash]);
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(struct RHash, ht)]);
+  test(reg_tmp1, reg_tmp1);
+  jz(".miss");
+  and(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, mask)]);
+
+  /* Only eax and edx are free. Key is in ecx, ed_flags in edi and
+     keys or bit index in ebx until .found or .lmiss */
+  push(reg_regs);
+  push(reg_vms);
+  push(reg_context);
+  mov(edi, ptr [reg_tmp1 + OffsetOf(kh_ht_t, ed_flags)]);
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    movzx(ecx, word [reg_regs + offkey]);
+  }
+  else {
+    mov(ecx, dword [reg_regs + offkey]);
+  }
+
+  /* Bit 2k + 1 of ed_flags is empty flag and bit 2k is deleted flag */
+  L(".loop");
+  lea(ebx, ptr [eax + eax + 1]);
+  bt(ptr [edi], ebx);
+  jc(".lmiss");
+  dec(ebx);
+  bt(ptr [edi], ebx);
+  jc(".next");
+  mov(ebx, ptr [reg_tmp1 + OffsetOf(kh_ht_t, keys)]);
+  if (kinfo->type == MRB_TT_SYMBOL) {
+    cmp(word [ebx + eax * sizeof(mrb_value)], cx);
+  }
+  else {
+    cmp(dword [ebx + eax * sizeof(mrb_value)], ecx);
+  }
+  jnz(".next");
+  cmp(dword [ebx + eax * sizeof(mrb_value) + 4], mrb_mktt(kinfo->type));
+  jz(".found");
+
+  L(".next");
+  add(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, inc)]);
+  and(eax, dword [reg_tmp1 + OffsetOf(kh_ht_t, mask)]);
+  jmp(".loop");
+
+  L(".lmiss");
+  pop(reg_context);
+  pop(reg_vms);
+  pop(reg_regs);
+  jmp(".miss");
+
+  L(".found");
+  pop(reg_context);
+  pop(reg_vms);
+  pop(reg_regs);
+  mov(reg_tmp1, ptr [reg_tmp1 + OffsetOf(kh_ht_t, vals)]);
+  lea(reg_tmp1, ptr [reg_tmp1 + reg_tmp0 * sizeof(mrb_value)]);
+#endif
+}
+
+/* Support only Symbol and Fixnum keys. Their hash value doesn't call
+   any method and mrb_eql of them is identity */
+static int
+hash_inline_key_p(int tt)
+{
+  return tt == MRB_TT_SYMBOL || tt == MRB_TT_FIXNUM;
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_hash_aget_impl(mrb_state *mrb, mrb_value proc,
+				       mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offhash = regno * sizeof(mrb_value);
+  const Xbyak::uint32 offkey = offhash + sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 1 ||
+      !hash_inline_key_p(mrb_type((*status->regs)[regno + 1]))) {
+    return mrb_nil_value();
+  }
+
+  inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_type_guard(mrb, regno + 1, status, pc, coi);
+
+  gen_hash_lookup(mrb, regno, status, coi);
+  movsd(xmm0, ptr [reg_tmp1]);
+  movsd(ptr [reg_regs + offhash], xmm0);
+  jmp(".exit");
+
+  /* Default value or default proc */
+  L(".miss");
+#ifdef XBYAK64
+  mov(rdx, qword [reg_regs + offkey]);
+  mov(rsi, qword [reg_regs + offhash]);
+  mov(rdi, reg_mrb);
+  gen_call((void *)mrbjit_exec_hash_get);
+#else
+  push(reg_regs);
+  push(reg_vms);
+  mov(eax, dword [reg_regs + offkey + 4]);
   push(eax);
+  mov(eax, dword [reg_regs + offkey]);
+  push(eax);
+  mov(eax, dword [reg_regs + offhash + 4]);
+  push(eax);
+  mov(eax, dword [reg_regs + offhash]);
+  push(eax);
+  push(reg_mrb);
+  call((void *)mrbjit_exec_hash_get);
+  add(reg_sp, sizeof(void *) + 2 * sizeof(mrb_value));
+  pop(reg_vms);
+  pop(reg_regs);
+#endif
+  gen_store_cret(offhash);
+
+  L(".exit");
+  outLocalLabel();
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+  dinfo->constp = 0;
+
+  return mrb_true_value();
+}
+
+extern "C" mrb_value
+mrbjit_prim_hash_aget(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_hash_aget_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_hash_aset_impl(mrb_state *mrb, mrb_value proc,
+				       mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offhash = regno * sizeof(mrb_value);
+  const Xbyak::uint32 offkey = offhash + sizeof(mrb_value);
+  const Xbyak::uint32 offval = offkey + sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 2 ||
+      !hash_inline_key_p(mrb_type((*status->regs)[regno + 1]))) {
+    return mrb_nil_value();
+  }
+
+  inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_type_guard(mrb, regno + 1, status, pc, coi);
 
-  mov(eax, ptr [ecx + offary + 4]);
+  /* Overwrite value of the existing key */
+  gen_hash_lookup(mrb, regno, status, coi);
+  movsd(xmm0, ptr [reg_regs + offval]);
+  movsd(ptr [reg_tmp1], xmm0);
+  gen_write_barrier(offhash, &coi->reginfo[regno + 2]);
+  jmp(".exit");
+
+  /* New key may resize the table */
+  L(".miss");
+#ifdef XBYAK64
+  mov(rcx, qword [reg_regs + offval]);
+  mov(rdx, qword [reg_regs + offkey]);
+  mov(rsi, qword [reg_regs + offhash]);
+  mov(rdi, reg_mrb);
+  gen_call((void *)mrbjit_exec_hash_set);
+#else
+  push(reg_regs);
+  push(reg_vms);
+  mov(eax, dword [reg_regs + offval + 4]);
+  push(eax);
+  mov(eax, dword [reg_regs + offval]);
+  push(eax);
+  mov(eax, dword [reg_regs + offkey + 4]);
   push(eax);
-  mov(eax, ptr [ecx + offary]);
+  mov(eax, dword [reg_regs + offkey]);
   push(eax);
+  mov(eax, dword [reg_regs + offhash + 4]);
+  push(eax);
+  mov(eax, dword [reg_regs + offhash]);
+  push(eax);
+  push(reg_mrb);
+  call((void *)mrbjit_exec_hash_set);
+  add(reg_sp, sizeof(void *) + 3 * sizeof(mrb_value));
+  pop(reg_vms);
+  pop(reg_regs);
+#endif
+
+  /* Hash#[]= returns the value */
+  L(".exit");
+  outLocalLabel();
+  movsd(xmm0, ptr [reg_regs + offval]);
+  movsd(ptr [reg_regs + offhash], xmm0);
+  *dinfo = coi->reginfo[regno + 2];
 
-  push(esi);
+  return mrb_true_value();
+}
 
-  call((void *)mrb_ary_set);
-  add(esp, 2 * sizeof(void *) + 2 * sizeof(mrb_value));
-  pop(ecx);
-  movsd(xmm0, ptr [ecx + offval]);
-  movsd(ptr [ecx + offary], xmm0);
+extern "C" mrb_value
+mrbjit_prim_hash_aset(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+{
+  MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
+
+  return code->mrbjit_prim_hash_aset_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+}
+
+mrb_value
+MRBJitCode::mrbjit_prim_hash_has_key_impl(mrb_state *mrb, mrb_value proc,
+					  mrbjit_vmstatus *status, mrbjit_code_info *coi)
+{
+  mrb_code *pc = *status->pc;
+  mrb_code i = *pc;
+  int regno = GETARG_A(i);
+  const Xbyak::uint32 offhash = regno * sizeof(mrb_value);
+  mrbjit_reginfo *dinfo = &coi->reginfo[regno];
+
+  if (GETARG_C(i) != 1 ||
+      !hash_inline_key_p(mrb_type((*status->regs)[regno + 1]))) {
+    return mrb_nil_value();
+  }
+
+  inLocalLabel();
+  gen_class_guard(mrb, regno, status, pc, coi);
+  gen_type_guard(mrb, regno + 1, status, pc, coi);
+
+  gen_hash_lookup(mrb, regno, status, coi);
+  mov(dword [reg_regs + offhash], 1);
+  mov(dword [reg_regs + offhash + 4], mrb_mktt(MRB_TT_TRUE));
   jmp(".exit");
 
-  L(".retnil");
-  add(esp, sizeof(void *) + sizeof(mrb_value)); // ecx, val
-  xor(eax, eax);
-  mov(dword [ecx + offary], eax);
-  mov(dword [ecx + offary + 4], 0xfff00000 | MRB_TT_FALSE);
+  L(".miss");
+  mov(dword [reg_regs + offhash], 1);
+  mov(dword [reg_regs + offhash + 4], mrb_mktt(MRB_TT_FALSE));
 
   L(".exit");
   outLocalLabel();
-  
+  dinfo->type = MRB_TT_FREE;
+  dinfo->klass = NULL;
+  dinfo->constp = 0;
+
   return mrb_true_value();
 }
 
 extern "C" mrb_value
-mrbjit_prim_ary_aset(mrb_state *mrb, mrb_value proc, void *status, void *coi)
+mrbjit_prim_hash_has_key(mrb_state *mrb, mrb_value proc, void *status, void *coi)
 {
   MRBJitCode *code = (MRBJitCode *)mrb->compile_info.code_base;
 
-  return code->mrbjit_prim_ary_aset_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
+  return code->mrbjit_prim_hash_has_key_impl(mrb, proc,  (mrbjit_vmstatus *)status, (mrbjit_code_info *)coi);
 }
 
 mrb_value
@@ -363,31 +1351,47 @@ MRBJitCode::mrbjit_prim_instance_new_impl(mrb_state *mrb, mrb_value proc,
 
   m = mrb_method_search_vm(mrb, &c, mrb_intern_cstr(mrb, "initialize"));
 
-  // TODO add guard of class
+  /* Free when klass is a folded constant */
+  gen_value_guard(mrb, a, status, pc, coi);
   
-  // obj = mrbjit_instance_alloc(mrb, klass);
-  push(ecx);
-  push(ebx);
-  mov(eax, *((Xbyak::uint32 *)(&klass) + 1));
-  push(eax);
-  mov(eax, *((Xbyak::uint32 *)(&klass)));
-  push(eax);
-  push(esi);
-  call((void *)mrbjit_instance_alloc);
-  add(esp, 3 * sizeof(void *));
-  pop(ebx);
-  pop(ecx);
+  /* c is the class which defines initialize now */
+  if (mrb_class_ptr(klass)->tt == MRB_TT_SCLASS) {
+    // obj = mrbjit_instance_alloc(mrb, klass); (raise TypeError)
+#ifdef XBYAK64
+    mov(rsi, (size_t)klass.value.p);
+    mov(rdi, reg_mrb);
+    gen_call((void *)mrbjit_instance_alloc);
+#else
+    push(reg_regs);
+    push(reg_vms);
+    mov(eax, *((Xbyak::uint32 *)(&klass) + 1));
+    push(eax);
+    mov(eax, *((Xbyak::uint32 *)(&klass)));
+    push(eax);
+    push(reg_mrb);
+    call((void *)mrbjit_instance_alloc);
+    add(reg_sp, 3 * sizeof(void *));
+    pop(reg_vms);
+    pop(reg_regs);
+#endif
+
+    // regs[a] = obj;
+    gen_store_cret(a * sizeof(mrb_value));
+  }
+  else {
+    struct RClass *k = mrb_class_ptr(klass);
+    enum mrb_vtype ttype = MRB_INSTANCE_TT(k);
+
+    if (ttype == 0) ttype = MRB_TT_OBJECT;
+    gen_alloc_object(mrb, ttype, k);
 
-  // regs[a] = obj;
-  mov(ptr [ecx + a * sizeof(mrb_value)], eax);
-  mov(ptr [ecx + a * sizeof(mrb_value) + 4], edx);
+    // regs[a] = obj;
+    gen_store_ptr_value(a * sizeof(mrb_value), reg_tmp0, ttype);
+  }
 
   if (MRB_PROC_CFUNC_P(m)) {
     CALL_CFUNC_BEGIN;
-    mov(eax, (Xbyak::uint32)c);
-    push(eax);
-    mov(eax, (Xbyak::uint32)m);
-    push(eax);
+    CALL_CFUNC_ARGS_PROC_CLASS(m, c);
     CALL_CFUNC_STATUS(mrbjit_exec_send_c, 2);
   }
   else {
@@ -403,13 +1407,10 @@ MRBJitCode::mrbjit_prim_instance_new_impl(mrb_state *mrb, mrb_value proc,
     
     /* call info setup */
     CALL_CFUNC_BEGIN;
-    mov(eax, (Xbyak::uint32)c);
-    push(eax);
-    mov(eax, (Xbyak::uint32)m);
-    push(eax);
+    CALL_CFUNC_ARGS_PROC_CLASS(m, c);
     CALL_CFUNC_STATUS(mrbjit_exec_send_mruby, 2);
 
-    mov(ecx, dword [ebx + VMSOffsetOf(regs)]);
+    mov(reg_regs, ptr [reg_vms + VMSOffsetOf(regs)]);
 
     gen_set_jit_entry(mrb, pc, coi, irep);
 
@@ -520,9 +1521,9 @@ MRBJitCode::mrbjit_prim_math_sqrt_impl(mrb_state *mrb, mrb_value proc,
 
   if (mrb_type(regs[src]) == MRB_TT_FLOAT) {
     gen_type_guard(mrb, src, status, pc, coi);
-    movsd(xmm0, ptr [ecx + srcoff]);
+    movsd(xmm0, ptr [reg_regs + srcoff]);
     sqrtsd(xmm0, xmm0);
-    movsd(ptr [ecx + dstoff], xmm0);
+    movsd(ptr [reg_regs + dstoff], xmm0);
     dinfo->type = MRB_TT_FLOAT;
     dinfo->klass = mrb->float_class;
 
@@ -530,9 +1531,9 @@ MRBJitCode::mrbjit_prim_math_sqrt_impl(mrb_state *mrb, mrb_value proc,
   }
   else if (mrb_type(regs[src]) == MRB_TT_FIXNUM) {
     gen_type_guard(mrb, src, status, pc, coi);
-    cvtsi2sd(xmm0, ptr [ecx + srcoff]);
+    cvtsi2sd(xmm0, ptr [reg_regs + srcoff]);
     sqrtsd(xmm0, xmm0);
-    movsd(ptr [ecx + dstoff], xmm0);
+    movsd(ptr [reg_regs + dstoff], xmm0);
     dinfo->type = MRB_TT_FLOAT;
     dinfo->klass = mrb->float_class;
 
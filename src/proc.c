@@ -211,9 +211,9 @@ mrb_init_proc(mrb_state *mrb)
     cinfo = (mrbjit_code_info *)mrb_calloc(mrb, 16, sizeof(mrbjit_code_info));
     call_irep->jit_entry_tab[i].body = cinfo;
   }
-  call_irep->prof_info = (int *)mrb_calloc(mrb, 2, sizeof(int));
   call_irep->method_kind = NORMAL;
   call_irep->jit_top_entry = NULL;
+  mrbjit_irep_link(mrb, call_irep);
   call_irep->simple_lambda = 1;
   call_irep->proc_obj = NULL;
 
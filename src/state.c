@@ -29,7 +29,7 @@ mrb_open_allocf(mrb_allocf f, void *ud)
   static const struct mrb_context mrb_context_zero = { 0 };
   mrb_state *mrb;
 
-#ifdef MRB_NAN_BOXING
+#if defined(MRB_NAN_BOXING) && !defined(__x86_64__)
   mrb_assert(sizeof(void*) == 4);
 #endif
 
@@ -46,6 +46,12 @@ mrb_open_allocf(mrb_allocf f, void *ud)
   mrb->compile_info.prev_coi = NULL;
   mrb->compile_info.disable_jit = 0;
   mrb->compile_info.nest_level = 0;
+  mrb->compile_info.code_area = mrbjit_alloc_code(MRBJIT_CODE_SIZE);
+  mrb->compile_info.code_capa = MRBJIT_CODE_SIZE;
+  mrb->compile_info.code_limit = MRBJIT_CODE_LIMIT;
+  if (mrb->compile_info.code_area == NULL) {
+    mrb->compile_info.disable_jit = 1;
+  }
 #ifndef MRB_GC_FIXED_ARENA
   mrb->arena = (struct RBasic**)mrb_malloc(mrb, sizeof(struct RBasic*)*MRB_GC_ARENA_SIZE);
   mrb->arena_capa = MRB_GC_ARENA_SIZE;
@@ -159,7 +165,6 @@ mrb_irep_free(mrb_state *mrb, mrb_irep *irep)
   mrb_free(mrb, irep->reps);
   mrb_free(mrb, (void *)irep->filename);
   mrb_free(mrb, irep->lines);
-  mrb_free(mrb, irep->prof_info);
   if (irep->jit_entry_tab) {
     int i;
     int j;
@@ -170,10 +175,13 @@ mrb_irep_free(mrb_state *mrb, mrb_irep *irep)
 	  mrb_free(mrb, irep->jit_entry_tab[i].body[j].reginfo);
 	}
       }
+      mrb_free(mrb, irep->jit_entry_tab[i].body);
     }
-    mrb_free(mrb, irep->jit_entry_tab->body);
     mrb_free(mrb, irep->jit_entry_tab);
+    mrbjit_irep_unlink(mrb, irep);
   }
+  mrb_free(mrb, irep->jit_prof);
+  mrb_free(mrb, irep->jit_exit_stat);
   mrb_debug_info_free(mrb, irep->debug_info);
   mrb_free(mrb, irep);
 }
@@ -236,6 +244,9 @@ mrb_close(mrb_state *mrb)
 #ifndef MRB_GC_FIXED_ARENA
   mrb_free(mrb, mrb->arena);
 #endif
+  mrbjit_free_code(mrb->compile_info.code_area);
+  mrb_free(mrb, mrb->compile_info.deps);
+  mrb_free(mrb, mrb->compile_info.sym_hash);
   mrb_free(mrb, mrb);
 }
 
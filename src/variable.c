@@ -11,6 +11,7 @@
 #include "mruby/proc.h"
 #include "mruby/string.h"
 #include "mruby/variable.h"
+#include "mruby/jit.h"
 
 typedef int (iv_foreach_func)(mrb_state*,mrb_sym,mrb_value,void*);
 
@@ -930,6 +931,7 @@ mrb_const_set(mrb_state *mrb, mrb_value mod, mrb_sym sym, mrb_value v)
 {
   mod_const_check(mrb, mod);
   mrb_iv_set(mrb, mod, sym, v);
+  mrbjit_invalidate(mrb, MRBJIT_DEP_CONST, sym);
 }
 
  void
@@ -939,6 +941,7 @@ mrb_vm_const_set(mrb_state *mrb, mrb_sym sym, mrb_value v)
 
   if (!c) c = mrb->c->ci->target_class;
   mrb_obj_iv_set(mrb, (struct RObject*)c, sym, v);
+  mrbjit_invalidate(mrb, MRBJIT_DEP_CONST, sym);
 }
 
 void
@@ -946,12 +949,16 @@ mrb_const_remove(mrb_state *mrb, mrb_value mod, mrb_sym sym)
 {
   mod_const_check(mrb, mod);
   mrb_iv_remove(mrb, mod, sym);
+  mrbjit_invalidate(mrb, MRBJIT_DEP_CONST, sym);
 }
 
 void
 mrb_define_const(mrb_state *mrb, struct RClass *mod, const char *name, mrb_value v)
 {
-  mrb_obj_iv_set(mrb, (struct RObject*)mod, mrb_intern_cstr(mrb, name), v);
+  mrb_sym sym = mrb_intern_cstr(mrb, name);
+
+  mrb_obj_iv_set(mrb, (struct RObject*)mod, sym, v);
+  mrbjit_invalidate(mrb, MRBJIT_DEP_CONST, sym);
 }
 
 void
@@ -111,7 +111,7 @@ stack_init(mrb_state *mrb)
 
   /* mrb_assert(ci == NULL); */
   c->cibase_org = (mrb_callinfo *)mrb_calloc(mrb, CALLINFO_INIT_SIZE + 2, sizeof(mrb_callinfo));
-  c->cibase = (mrb_callinfo *)((((int)(c->cibase_org)) & (~(64 - 1))) + 64);
+  c->cibase = (mrb_callinfo *)((((intptr_t)(c->cibase_org)) & (~(64 - 1))) + 64);
   c->ciend = c->cibase + CALLINFO_INIT_SIZE;
   c->ci = c->cibase;
   c->ci->target_class = mrb->object_class;
@@ -394,7 +394,7 @@ cipush(mrb_state *mrb)
 
     c->cibase_org = (mrb_callinfo *)mrb_malloc(mrb, sizeof(mrb_callinfo)*size*2 + 64);
     sci = c->cibase;
-    c->cibase = (mrb_callinfo *)((((int)(c->cibase_org)) & (~(64 - 1))) + 64);
+    c->cibase = (mrb_callinfo *)((((intptr_t)(c->cibase_org)) & (~(64 - 1))) + 64);
     for (dci = c->cibase; sci <= c->ci; sci++, dci++) {
       *dci = *sci;
     }
@@ -798,25 +798,56 @@ mrbjit_argnum_error(mrb_state *mrb, int num)
 extern const void *mrbjit_get_curr(mrb_state *);
 extern const void *mrbjit_emit_code(mrb_state *, mrbjit_vmstatus *, mrbjit_code_info *);
 extern void mrbjit_gen_exit(mrbjit_code_area, mrb_state *, mrb_irep *, mrb_code **, mrbjit_vmstatus *);
-extern void mrbjit_gen_jump_block(mrbjit_code_area, void *);
-extern void mrbjit_gen_jmp_patch(mrbjit_code_area, void *, void *);
-extern void mrbjit_gen_exit_patch(mrbjit_code_area, void *, mrb_code *, mrbjit_vmstatus *);
-extern void mrbjit_gen_align(mrbjit_code_area, unsigned);
+extern void mrbjit_gen_jump_block(mrb_state *, mrbjit_code_area, void *);
+extern void *mrbjit_jump_entry(mrb_state *, mrb_irep *, mrb_code *, mrbjit_code_info *, mrbjit_code_info *);
+extern void mrbjit_gen_jmp_patch(mrb_state *, void *, void *);
+extern void mrbjit_gen_align(mrb_state *, unsigned);
+#if defined(__x86_64__)
+extern void *mrbjit_enter_trace(mrb_state *, mrbjit_vmstatus *, void *, void **);
+#endif
+
+static inline size_t
+mrbjit_codeinfo_hash(mrb_code *prev_pc, mrb_code *caller_pc)
+{
+  /* caller_pc of inlined method is odd (MRBJIT_INLINE_CALLER) */
+  uintptr_t h = (uintptr_t)prev_pc ^ ((uintptr_t)caller_pc << 3);
 
+  return (size_t)((h >> 2) ^ (h >> 11));
+}
+
+/* Return the slot of the key or the empty slot for it */
 static inline mrbjit_code_info *
-mrbjit_search_codeinfo_prev_inline(mrbjit_codetab *tab, mrb_code *prev_pc, mrb_code *caller_pc)
+mrbjit_codeinfo_probe(mrbjit_codetab *tab, mrb_code *prev_pc, mrb_code *caller_pc)
 {
-  volatile int i;		/* volatile avoid bug (maybe gcc?) */
+  size_t mask = tab->size - 1;
+  size_t i = mrbjit_codeinfo_hash(prev_pc, caller_pc) & mask;
   mrbjit_code_info *entry;
 
-  for (i = 0; i < tab->size; i++) {
+  for (;;) {
     entry = tab->body + i;
-    if (entry->prev_pc == prev_pc && entry->caller_pc == caller_pc) {
+    if (entry->used == 0 ||
+	(entry->prev_pc == prev_pc && entry->caller_pc == caller_pc)) {
       return entry;
     }
+    i = (i + 1) & mask;
   }
+}
 
-  return NULL;
+static inline mrbjit_code_info *
+mrbjit_search_codeinfo_prev_inline(mrbjit_codetab *tab, mrb_code *prev_pc, mrb_code *caller_pc)
+{
+  mrbjit_code_info *entry;
+
+  if (tab->size == 0) {
+    return NULL;
+  }
+  entry = mrbjit_codeinfo_probe(tab, prev_pc, caller_pc);
+  if (entry->used == 0 && tab->num >= MRBJIT_SPECIALIZE_MAX) {
+    /* Too many paths to pc. Use the generic trace */
+    entry = mrbjit_codeinfo_probe(tab, NULL, caller_pc);
+  }
+
+  return (entry->used == 0) ? NULL : entry;
 }
 
 mrbjit_code_info *
@@ -825,35 +856,114 @@ mrbjit_search_codeinfo_prev(mrbjit_codetab *tab, mrb_code *prev_pc, mrb_code *ca
   return mrbjit_search_codeinfo_prev_inline(tab, prev_pc, caller_pc);
 }
 
-static inline mrbjit_code_info *
-add_codeinfo(mrb_state *mrb, mrbjit_codetab *tab, mrb_irep *irep)
+/* Rehash code info table to size or larger */
+void
+mrbjit_grow_codetab(mrb_state *mrb, mrbjit_codetab *tab, int size)
 {
+  mrbjit_codetab newtab;
+  mrbjit_code_info *prev_coi = mrb->compile_info.prev_coi;
   int i;
-  int oldsize;
-  mrbjit_code_info *ele;
-  oldsize = -1;
 
- retry:
-  if (tab->body == NULL || oldsize >= 0) {
-    oldsize = tab->size;
-    tab->size = oldsize + (oldsize >> 1) + 2;
-    tab->body = mrb_realloc(mrb, tab->body, sizeof(mrbjit_code_info) * tab->size);
-    for (i = oldsize; i < tab->size; i++) {
-      tab->body[i].used = 0;
-      tab->body[i].reginfo = NULL;
-    }
+  newtab.size = (tab->size > 0) ? tab->size : 4;
+  while (newtab.size < size) {
+    newtab.size *= 2;
+  }
+  if (newtab.size == tab->size) {
+    return;
   }
+  newtab.num = tab->num;
+  newtab.body = (mrbjit_code_info *)mrb_calloc(mrb, newtab.size, sizeof(mrbjit_code_info));
 
-  oldsize = tab->size;
   for (i = 0; i < tab->size; i++) {
-    ele = tab->body + i;
+    mrbjit_code_info *ele = tab->body + i;
+    mrbjit_code_info *newele;
+
     if (ele->used == 0) {
-      return ele;
+      mrb_free(mrb, ele->reginfo);
+      continue;
+    }
+    newele = mrbjit_codeinfo_probe(&newtab, ele->prev_pc, ele->caller_pc);
+    *newele = *ele;
+    if (prev_coi == ele) {
+      mrb->compile_info.prev_coi = newele;
     }
   }
 
-  /* Grow code info table */
-  goto retry;
+  mrb_free(mrb, tab->body);
+  *tab = newtab;
+}
+
+static inline mrbjit_code_info *
+add_codeinfo(mrb_state *mrb, mrbjit_codetab *tab, mrb_code *prev_pc, mrb_code *caller_pc)
+{
+  mrbjit_code_info *ele;
+
+  if ((tab->num + 1) * 2 > tab->size) {
+    mrbjit_grow_codetab(mrb, tab, tab->size * 2);
+  }
+
+  ele = mrbjit_codeinfo_probe(tab, prev_pc, caller_pc);
+  ele->prev_pc = prev_pc;
+  ele->caller_pc = caller_pc;
+  tab->num++;
+
+  return ele;
+}
+
+/* Count side exit whose stub is at exit and return the times */
+static inline int
+mrbjit_count_exit(mrb_state *mrb, void *exit)
+{
+  size_t i = MRBJIT_EXIT_HASH(exit);
+
+  return ++mrb->compile_info.exit_count[i];
+}
+
+/* Statistics of side exit to pc. Guard of the exit is stored by
+   the exit stub */
+static void
+mrbjit_stat_exit(mrb_state *mrb, mrb_irep *irep, mrb_code *pc)
+{
+  mrbjit_stats *stats = &mrb->compile_info.stats;
+  enum mrbjit_exit_kind kind = (enum mrbjit_exit_kind)mrb->compile_info.exit_kind;
+  int off = ISEQ_OFFSET_OF(pc);
+  mrbjit_exit_stat *st;
+  int i;
+
+  stats->side_exits++;
+  for (i = 0; i < irep->jit_exit_stat_num; i++) {
+    st = irep->jit_exit_stat + i;
+    if (st->pc == off && st->kind == kind) {
+      st->count++;
+      return;
+    }
+  }
+  irep->jit_exit_stat = (mrbjit_exit_stat *)mrb_realloc(mrb, irep->jit_exit_stat,
+							sizeof(mrbjit_exit_stat) * (i + 1));
+  st = irep->jit_exit_stat + i;
+  st->pc = off;
+  st->kind = kind;
+  st->count = 1;
+  irep->jit_exit_stat_num = i + 1;
+}
+
+/* Count execution of pc n of irep which has no code table yet.
+   Return TRUE when n is a trace head and it is hot */
+static int
+mrbjit_prof_hot(mrb_state *mrb, mrb_irep *irep, int n)
+{
+  int i;
+
+  if (irep->jit_prof == NULL) {
+    mrbjit_make_jit_prof(mrb, irep);
+  }
+  for (i = 0; i < irep->jit_prof_num; i++) {
+    if (irep->jit_prof[i].pc == n) {
+      return irep->jit_prof[i].count++ >= COMPILE_THRESHOLD;
+    }
+  }
+
+  return FALSE;
 }
 
 extern void disasm_once(mrb_state *, mrb_irep *, mrb_code);
@@ -871,19 +981,49 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
   void *(*entry)() = NULL;
   void *(*prev_entry)() = NULL;
   void *rc = NULL;
+  int hot;
   int i;
 
   if (mrb->compile_info.disable_jit ||
       irep->method_kind != NORMAL) {
     return status->optable[GET_OPCODE(**ppc)];
   }
+  n = ISEQ_OFFSET_OF(*ppc);
   if (irep->jit_entry_tab == NULL) {
+    if (mrb->compile_info.code_base == NULL && !mrbjit_prof_hot(mrb, irep, n)) {
+      /* Cold irep has no code table */
+      mrb->compile_info.prev_pc = *ppc;
+      mrb->compile_info.prev_coi = NULL;
+      return status->optable[GET_OPCODE(**ppc)];
+    }
     mrbjit_make_jit_entry_tab(mrb, irep, irep->ilen);
   }
 
+  if (mrb->compile_info.code_base == NULL &&
+      irep->jit_entry_tab[n].body == NULL &&
+      irep->jit_entry_tab[n].prof < 0) {
+    /* Neither compiled nor head of trace */
+    mrb->compile_info.prev_pc = *ppc;
+    mrb->compile_info.prev_coi = NULL;
+    return status->optable[GET_OPCODE(**ppc)];
+  }
+
   prev_pc = mrb->compile_info.prev_pc;
+  if (prev_pc < irep->iseq || prev_pc >= irep->iseq + irep->ilen) {
+    /* Came from other method (e.g. return from callee). Register
+       types are unknown there, so all such paths share the generic
+       trace, which is the continuation of send (see ret_entry) */
+    prev_pc = NULL;
+  }
 
-  if (irep->ilen < NO_INLINE_METHOD_LEN || irep->jit_inlinep) {
+  if (mrb->compile_info.code_base == NULL) {
+    /* Inlined method ends with the trace */
+    mrb->compile_info.inline_pc = NULL;
+  }
+  if (mrb->compile_info.inline_pc) {
+    caller_pc = MRBJIT_INLINE_CALLER(mrb->compile_info.inline_pc);
+  }
+  else if (irep->ilen < NO_INLINE_METHOD_LEN || irep->jit_inlinep) {
     caller_pc = mrb->c->ci->pc;
   }
   else {
@@ -892,21 +1032,34 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
   }
 
   cbase = mrb->compile_info.code_base;
-  n = ISEQ_OFFSET_OF(*ppc);
   ci = mrbjit_search_codeinfo_prev_inline(irep->jit_entry_tab + n, prev_pc, caller_pc);
   if (ci) {
     if (cbase) {
       if (ci->used > 0) {
-	mrbjit_gen_jump_block(cbase, ci->entry);
+	mrbjit_code_info *prev_coi = NULL;
+
+	if (prev_pc >= irep->iseq && prev_pc < irep->iseq + irep->ilen) {
+	  prev_coi = mrb->compile_info.prev_coi;
+	}
+	mrbjit_gen_jump_block(mrb, cbase, mrbjit_jump_entry(mrb, irep, *ppc, ci, prev_coi));
 	cbase = mrb->compile_info.code_base = NULL;
       }
     }
+    else if (ci->used > 0 && ci->loop_body) {
+      /* Interpreter didn't pass the guards of the loop pre-header.
+	 The trace is entered at the loop head */
+      ci = NULL;
+      goto skip;
+    }
 
     if (cbase == NULL && ci->used > 0) {
       prev_pc = *ppc;
 
       //printf("%x %x \n", ci->entry, *ppc);
 
+#if defined(__x86_64__)
+      rc = mrbjit_enter_trace(mrb, status, (void *)ci->entry, (void **)&prev_entry);
+#else
       asm volatile("mov %0, %%ecx\n\t"
 		   "mov %1, %%ebx\n\t"
 		   "mov %2, %%esi\n\t"
@@ -931,11 +1084,15 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
 		   : "=c"(rc));
       asm volatile("mov %%edx, %0\n\t"
 		   : "=c"(prev_entry));
+#endif
 
       irep = *status->irep;
       regs = *status->regs;
       *(status->pool) = irep->pool;
       *(status->syms) = irep->syms;
+      if (prev_entry && rc == NULL) {
+	mrbjit_stat_exit(mrb, irep, *ppc);
+      }
       //disasm_once(mrb, irep, **ppc);
       //mrb_irep *search_irep(mrb_state *mrb, mrb_code *pc);
       //if (search_irep(mrb, *ppc) != irep) {
@@ -945,9 +1102,16 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
 
       /* Skip Internal guard fail */
       switch(GET_OPCODE(**ppc)) {
-      case OP_CALL:
       case OP_SEND:
       case OP_SENDB:
+	if (rc == NULL && prev_entry &&
+	    mrb->compile_info.exit_kind == MRBJIT_EXIT_CLASS) {
+	  /* Receiver class guard fail. Branch trace from here
+	     is an entry of polymorphic inline cache */
+	  break;
+	}
+	/* fall through */
+      case OP_CALL:
       case OP_RETURN:
 	ci = NULL;
 	goto skip;
@@ -964,38 +1128,73 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
       if (irep->jit_entry_tab == NULL) {
 	mrbjit_make_jit_entry_tab(mrb, irep, irep->ilen);
       }
+      if (prev_entry && rc == NULL) {
+	/* Left by side exit. Branch trace from the exit is keyed by
+	   address of the exit stub, so only the exit enters it */
+	prev_pc = (mrb_code *)prev_entry;
+      }
       ci = mrbjit_search_codeinfo_prev_inline(irep->jit_entry_tab + n, prev_pc, caller_pc);
     }
   }
 
-  if (irep->prof_info[n]++ > COMPILE_THRESHOLD) {
+  if (cbase) {
+    /* Trace is recorded while it runs */
+    hot = 1;
+  }
+  else {
+    hot = (irep->jit_entry_tab[n].prof >= 0 &&
+	   irep->jit_entry_tab[n].prof++ > COMPILE_THRESHOLD);
+  }
+  if (prev_entry && rc == NULL) {
+    /* Make branch trace (patched to the exit below) when the exit
+       is hot */
+    hot = (mrbjit_count_exit(mrb, prev_entry) > MRBJIT_EXIT_THRESHOLD);
+  }
+
+  if (hot) {
     //      printf("size %x %x %x\n", irep->jit_entry_tab[n].size, *ppc, prev_pc);
     if (ci == NULL) {
       //printf("p %x %x\n", *ppc, prev_pc);
-      ci = add_codeinfo(mrb, irep->jit_entry_tab + n, irep);
-      ci->prev_pc = prev_pc;
-      ci->caller_pc = caller_pc;
+      if (irep->jit_entry_tab[n].num >= MRBJIT_SPECIALIZE_MAX) {
+	/* Generic trace of pc */
+	prev_pc = NULL;
+      }
+      ci = add_codeinfo(mrb, irep->jit_entry_tab + n, prev_pc, caller_pc);
+      if (prev_entry && rc == NULL &&
+	  mrb->compile_info.exit_kind == MRBJIT_EXIT_CLASS) {
+	/* Next entry of polymorphic inline cache */
+	ci->pic_num = mrb->compile_info.exit_pic_num;
+      }
+      else {
+	ci->pic_num = 0;
+      }
       ci->code_base = mrb->compile_info.code_base;
       ci->entry = NULL;
+      ci->loop_entry = NULL;
       ci->used = -1;
     }
 
-    if (prev_pc) {
+    if (ci->prev_pc && ci->prev_pc != (mrb_code *)prev_entry) {
       ci->prev_coi = mrb->compile_info.prev_coi;
     }
     else {
+      /* Types of registers are unknown (e.g. top of branch trace) */
       ci->prev_coi = NULL;
     }
 
     if (ci->reginfo == NULL) {
       ci->reginfo = (mrbjit_reginfo *)mrb_calloc(mrb, irep->nregs, sizeof(mrbjit_reginfo));
     }
-    if (ci->prev_coi && ci->prev_coi->reginfo) {
+    if (ci->prev_coi && ci->prev_coi->reginfo &&
+	ci->prev_pc >= irep->iseq && ci->prev_pc < irep->iseq + irep->ilen) {
+      /* Register types are known only in the same method */
       mrbjit_reginfo *prev_rinfo;
       prev_rinfo = ci->prev_coi->reginfo;
       for (i = 0; i < irep->nregs; i++) {
 	ci->reginfo[i] = prev_rinfo[i];
       }
+      ci->loop_body = (ci->prev_coi->loop_body ||
+		       ci->prev_coi->loop_entry != NULL);
     }
     else {
       for (i = 0; i < irep->nregs; i++) {
@@ -1003,19 +1202,29 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
 	ci->reginfo[i].klass = NULL;
 	ci->reginfo[i].constp = 0;
       }
+      ci->loop_body = 0;
     }
 
     if (ci->used < 0) {
+      int flush_count = mrb->compile_info.flush_count;
+
       entry = mrbjit_emit_code(mrb, status, ci);
+      if (mrb->compile_info.flush_count != flush_count) {
+	/* Code cache is flushed. All code info is reset */
+	ci = NULL;
+	goto skip;
+      }
       if (prev_entry && entry) {
 	//printf("patch %x %x \n", prev_entry, entry);
-	cbase = mrb->compile_info.code_base;
-	mrbjit_gen_jmp_patch(cbase, prev_entry, entry);
+	mrbjit_gen_jmp_patch(mrb, prev_entry, entry);
       }
 
       if (entry) {
 	ci->entry = entry;
 	ci->used = 1;
+	if (ci->prev_pc == NULL && ci->caller_pc == NULL) {
+	  irep->jit_entry_tab[n].ret_entry = entry;
+	}
 	if (n == 0) {
 	  /* This is for OP_CALL */
 	  irep->jit_top_entry = entry;
@@ -1036,7 +1245,7 @@ mrbjit_dispatch(mrb_state *mrb, mrbjit_vmstatus *status)
   if (cbase && entry == NULL) {
     /* Finish compile */
     mrbjit_gen_exit(cbase, mrb, irep, ppc, status);
-    //mrbjit_gen_align(cbase, 16);
+    //mrbjit_gen_align(mrb, 16);
     mrb->compile_info.code_base = NULL;
     mrb->compile_info.nest_level = 0;
   }
@@ -2688,32 +2897,9 @@ RETRY_TRY_BLOCK:
       /* A B            R(A).newmethod(Sym(B),R(A+1)) */
       int a = GETARG_A(i);
       struct RClass *c = mrb_class_ptr(regs[a]);
-      khash_t(mt) *h = c->mt;
-      khiter_t k;
-      struct RProc *p;
-
-      if (h) {
-	k = kh_get(mt, mrb, h, syms[GETARG_B(i)]);
-	if (k != kh_end(h)) {
-	  p = kh_value(h, k);
-	  if (p && !MRB_PROC_CFUNC_P(p)) {
-	    /* Disable JIT output code for redefined method */
-	    mrb_irep *irep = p->body.irep;
-	    mrbjit_codetab *tab = irep->jit_entry_tab;
-	    mrbjit_code_info *entry;
-	    int i;
-
-	    for (i = 0; i < tab->size; i++) {
-	      entry = tab->body + i;
-	      if (entry->used > 0) {
-		mrbjit_code_area cbase = mrb->compile_info.code_base;
-		mrbjit_gen_exit_patch(cbase, entry->entry, pc, &status);
-	      }
-	    }
-	  }
-	}
-      }
 
+      /* Code which depends on the old method is invalidated by
+         mrb_define_method_vm */
       mrb_proc_ptr(regs[a+1])->body.irep->jit_inlinep = 0;
       mrb_define_method_vm(mrb, c, syms[GETARG_B(i)], regs[a+1]);
       ARENA_RESTORE(mrb, ai);
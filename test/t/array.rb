@@ -346,3 +346,22 @@ assert("Array (Longish inline array)") do
   ary.each {|p| h[p.class] += 1}
   assert_equal({Array=>200}, h)
 end
+
+assert("Array (push and pop in loop)") do
+  a = []
+  b = [1, 2, 3].slice(0, 2)
+  100.times do |i|
+    a.push i
+    a << i
+    b << i
+  end
+  assert_equal(200, a.size)
+  assert_equal(102, b.length)
+  assert_equal(0, a.first)
+  assert_equal(99, a.last)
+  s = 0
+  s += a.pop until a.empty?
+  assert_equal(9900, s)
+  assert_nil(a.first)
+  assert_nil(a.pop)
+end
@@ -167,3 +167,21 @@ assert('Float#nan?') do
   assert_false (1.0/0.0).nan?
   assert_false (-1.0/0.0).nan?
 end
+
+assert('Float rounding in loop') do
+  a = []
+  [2.5, -2.5, 1.2, -1.2, 0.0, 1.0e20].each do |f|
+    a << [f.floor, f.ceil, f.round, f.truncate, f.abs, f ** 2]
+  end
+  assert_equal [2, 3, 3, 2, 2.5, 6.25], a[0]
+  assert_equal [-3, -2, -3, -2, 2.5, 6.25], a[1]
+  assert_equal [1, 2, 1, 1, 1.2, 1.2 * 1.2], a[2]
+  assert_equal [-2, -1, -1, -1, 1.2, 1.2 * 1.2], a[3]
+  assert_equal [0, 0, 0, 0, 0.0, 0.0], a[4]
+  assert_equal [1.0e20, 1.0e20, 1.0e20, 1.0e20, 1.0e20, 1.0e40], a[5]
+  s = 0
+  [3, -3, 46341].each do |i|
+    s += i.abs + i ** 2
+  end
+  assert_equal 18 + 46341 + 46341 ** 2, s
+end
@@ -331,3 +331,21 @@ assert('Hash#inspect') do
   assert_include ret, '"a"=>100'
   assert_include ret, '"d"=>400'
 end
+
+assert('Hash (Symbol and Fixnum keys in loop)') do
+  h = Hash.new(-1)
+  100.times do |i|
+    h[i] = i * 2
+    h[:a] = i
+  end
+  s = 0
+  100.times do |i|
+    s += h[i] if h.key?(i)
+  end
+  assert_equal(9900, s)
+  assert_equal(99, h[:a])
+  assert_equal(-1, h[:b])
+  assert_false(h.key?(100))
+  h.delete(:a)
+  assert_equal(-1, h[:a])
+end
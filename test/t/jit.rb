@@ -0,0 +1,339 @@
+# Not ISO specified
+
+assert('JIT.stats') do
+  s = JIT.stats
+  assert_kind_of Hash, s
+  [:traces, :aborts, :code_size, :code_capa, :flush_count, :side_exits].each do |k|
+    assert_kind_of Fixnum, s[k]
+  end
+  assert_kind_of Float, s[:compile_time]
+  assert_kind_of Hash, s[:abort_ops]
+  assert_equal [:bool, :class, :invalid, :other, :type], s[:exit_kinds].keys.sort
+  assert_kind_of Array, s[:exits]
+end
+
+assert('JIT.stats counts traces and exits of hot loop') do
+  before = JIT.stats
+  a = 0
+  i = 0
+  head = __LINE__ + 1
+  while i < 1000
+    a += i
+    i += 1
+  end
+  tail = __LINE__
+  after = JIT.stats
+
+  assert_equal 499500, a
+  # One trace of the loop, left once when the loop ends
+  assert_equal before[:traces] + 1, after[:traces]
+  assert_equal before[:side_exits] + 1, after[:side_exits]
+  assert_equal before[:flush_count], after[:flush_count]
+
+  counts = {}
+  before[:exits].each { |e| counts[e[0, 4]] = e[4] }
+  taken = after[:exits].select { |e| e[4] != counts[e[0, 4]].to_i }
+  assert_equal 1, taken.size
+  file, line, pc, kind, times = taken[0]
+  assert_true line >= head && line <= tail
+  assert_equal counts[[file, line, pc, kind]].to_i + 1, times
+  assert_equal before[:exit_kinds][kind] + 1, after[:exit_kinds][kind]
+end
+
+assert('JIT.code_limit') do
+  old = JIT.code_limit
+  assert_true JIT.stats[:code_capa] <= old
+  assert_equal 64 * 1024 * 1024, (JIT.code_limit = 64 * 1024 * 1024)
+  assert_equal 64 * 1024 * 1024, JIT.code_limit
+  assert_raise(ArgumentError) { JIT.code_limit = 0 }
+  JIT.code_limit = old
+end
+
+assert('JIT.enable_stats') do
+  old = JIT.enable_stats
+  assert_true JIT.enable_stats
+  assert_true JIT.disable_stats
+  assert_false JIT.disable_stats
+  JIT.enable_stats if old
+end
+
+assert('JIT reads ivar of objects with different layouts') do
+  class JITIvarLayout
+    attr_reader :a, :b
+    def initialize(first)
+      if first
+        @a = 1
+        @b = 2
+      else
+        @b = 2
+        @a = 1
+      end
+    end
+
+    def sum
+      @a * 10 + @b
+    end
+  end
+
+  objs = [JITIvarLayout.new(true), JITIvarLayout.new(false)]
+  s = 0
+  t = 0
+  i = 0
+  while i < 1000
+    o = objs[i % 2]
+    s += o.a * 10 + o.b
+    t += o.sum
+    i += 1
+  end
+  assert_equal 12000, s
+  assert_equal 12000, t
+end
+
+assert('JIT inlines small method') do
+  class JITInline
+    def add2(x, y)
+      z = x + y
+      z * 2
+    end
+
+    def unset(x)
+      if x > 5000
+        t = x
+      end
+      t
+    end
+  end
+
+  o = JITInline.new
+  s = 0
+  n = 0
+  i = 0
+  while i < 1000
+    # Float on later iterations exits in the inlined body
+    v = i < 900 ? i : i.to_f
+    s += o.add2(v, 1)
+    w = i
+    n += 1 if o.unset(w).nil?
+    i += 1
+  end
+  assert_equal 1001000.0, s
+  assert_equal 1000, n
+end
+
+assert('JIT looks up Hash by Symbol and Fixnum keys') do
+  keys = [:a, :b, :c, :jit_hash_new_key]
+  h = {:a => 1, :b => 2, :c => 3}
+  g = Hash.new(0)
+  s = 0
+  i = 0
+  while i < 1000
+    k = keys[i % 4]
+    s += h[k] || 100
+    g[i % 7] += 1
+    h[:d] = i if h.has_key?(:c)
+    i += 1
+  end
+  assert_equal 250 * (1 + 2 + 3 + 100), s
+  assert_equal 143, g[0]
+  assert_equal 142, g[6]
+  assert_equal 999, h[:d]
+end
+
+assert('JIT stores to Array in place and falls back') do
+  a = [0] * 10
+  b = []
+  c = [0, 0]
+  e = nil
+  i = 0
+  begin
+    while i < 1000
+      a[i % 10] = i
+      a[-1] = -i
+      b[i * 2] = i
+      # Out of range negative index raises in the fallback
+      c[-3] = i if i == 999
+      i += 1
+    end
+  rescue IndexError => e
+  end
+  assert_equal [990, 991, 992, 993, 994, 995, 996, 997, 998, -999], a
+  assert_equal 1999, b.size
+  assert_equal 998, b[1996]
+  assert_nil b[1997]
+  assert_kind_of IndexError, e
+end
+
+assert('JIT stores new object to old Array across GC') do
+  origin = GC.generational_mode
+  begin
+    GC.generational_mode = true
+    old = Array.new(10)
+    GC.start
+    i = 0
+    while i < 1000
+      old[i % 10] = "s" + i.to_s
+      t = "garbage" * 4
+      i += 1
+    end
+    GC.start
+    assert_equal "s990", old[0]
+    assert_equal "s999", old[9]
+  ensure
+    GC.generational_mode = origin
+  end
+end
+
+assert('JIT runs hot integer iterators') do
+  s = 0
+  1000.times {|i| s += i }
+  assert_equal 499500, s
+
+  s = 0
+  1.upto(1000) {|i| s += i }
+  assert_equal 500500, s
+
+  s = 0
+  1000.downto(1) {|i| s += i }
+  assert_equal 500500, s
+
+  s = 0
+  1.step(1999, 2) {|i| s += i }
+  assert_equal 1000000, s
+
+  s = 0
+  (0...1000).each {|i| s += i }
+  assert_equal 499500, s
+
+  # Block sees a Float on later iterations
+  s = 0
+  (0..999).each {|i| s += (i < 900 ? i : i * 1.0) }
+  assert_equal 499500.0, s
+
+  n = 0
+  (1..1000).each do |i|
+    next if i % 3 == 0
+    break if i > 900
+    n += 1
+  end
+  assert_equal 600, n
+end
+
+assert('JIT invalidates code when method or constant changes') do
+  class JITInvalidate
+    LIMIT = 1
+    def val
+      1
+    end
+  end
+
+  o = JITInvalidate.new
+  s = 0
+  t = 0
+  i = 0
+  while i < 1000
+    s += o.val
+    t += JITInvalidate::LIMIT
+    if i == 500
+      JITInvalidate.class_eval do
+        def val
+          10
+        end
+      end
+      JITInvalidate.const_set(:LIMIT, 100)
+    end
+    i += 1
+  end
+  assert_equal 501 + 499 * 10, s
+  assert_equal 501 + 499 * 100, t
+end
+
+assert('JIT runs begin/rescue/ensure in hot loop') do
+  r = 0
+  e = 0
+  s = 0
+  i = 0
+  while i < 1000
+    begin
+      raise ArgumentError if i % 10 == 0
+      s += i
+    rescue ArgumentError
+      r += 1
+    ensure
+      e += 1
+    end
+    i += 1
+  end
+  assert_equal 100, r
+  assert_equal 1000, e
+  assert_equal 499500 - 49500, s
+end
+
+assert('JIT allocates objects in hot loop') do
+  class JITAlloc
+    attr_reader :a, :b
+    def initialize(a, b)
+      @a = a
+      @b = b
+    end
+  end
+
+  # More objects than the arena and a GC step, most of them garbage
+  keep = []
+  s = 0
+  i = 0
+  while i < 20000
+    o = JITAlloc.new(i, "x")
+    keep << o if i % 100 == 0
+    s += o.a
+    i += 1
+  end
+  GC.start
+  assert_equal 199990000, s
+  assert_equal 200, keep.size
+  k = 0
+  while k < 200
+    assert_equal k * 100, keep[k].a
+    assert_equal "x", keep[k].b
+    k += 1
+  end
+end
+
+assert('JIT builds strings and hashes in hot loop') do
+  a = 0
+  t = nil
+  h = nil
+  len = 0
+  i = 0
+  while i < 1000
+    t = "#{i}:#{a}"
+    len += t.size
+    h = {:i => i, "k" => t}
+    a += h[:i]
+    i += 1
+  end
+  assert_equal "999:498501", t
+  assert_equal 9234, len
+  assert_equal 999, h[:i]
+  assert_equal "999:498501", h["k"]
+  assert_equal 499500, a
+end
+
+assert('JIT inlines block of iterator in hot loop') do
+  ary = (1..100).to_a
+  s = 0
+  m = 0
+  j = 0
+  while j < 50
+    ary.each {|x| s += x }
+    # Block captures j, and yield of the Ruby method calls it
+    m += ary.inject(0) {|acc, x| acc + x * j }
+    j += 1
+  end
+  assert_equal 50 * 5050, s
+  assert_equal 5050 * 1225, m
+
+  # Block escapes and is called after the iterator returns
+  procs = []
+  3.times {|k| procs << lambda { k * 2 } }
+  assert_equal [0, 2, 4], procs.map {|pr| pr.call }
+end
@@ -31,6 +31,14 @@ assert('Range#each', '15.2.14.4.4') do
   b = 0
   a.each {|i| b += i}
   assert_equal 6, b
+
+  b = []
+  (1...4).each {|i| b << i}
+  assert_equal [1, 2, 3], b
+
+  b = []
+  ('a'..'c').each {|i| b << i}
+  assert_equal ['a', 'b', 'c'], b
 end
 
 assert('Range#end', '15.2.14.4.5') do